@@ -0,0 +1,98 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace dae
+{
+	//Owning fixed size array that starts on an Alignment boundary, used for data that gets walked during traversal
+	//T has to be trivially copyable, elements are value initialized on allocation
+	template<typename T, size_t Alignment = 64>
+	class AlignedBuffer final
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "AlignedBuffer never runs destructors and gets copied with std::copy_n");
+
+	public:
+		AlignedBuffer() = default;
+		explicit AlignedBuffer(size_t size)
+		{
+			Allocate(size);
+		}
+
+		~AlignedBuffer()
+		{
+			Free();
+		}
+
+		AlignedBuffer(const AlignedBuffer&) = delete;
+		AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+		AlignedBuffer(AlignedBuffer&& other) noexcept :
+			m_pData{ std::exchange(other.m_pData, nullptr) },
+			m_Size{ std::exchange(other.m_Size, 0) }
+		{
+		}
+
+		AlignedBuffer& operator=(AlignedBuffer&& other) noexcept
+		{
+			if (this != &other)
+			{
+				Free();
+
+				m_pData = std::exchange(other.m_pData, nullptr);
+				m_Size = std::exchange(other.m_Size, 0);
+			}
+
+			return *this;
+		}
+
+		void Allocate(size_t size)
+		{
+			Free();
+
+			if (size == 0) return;
+
+			m_pData = static_cast<T*>(::operator new[](size * sizeof(T), std::align_val_t{ Alignment }));
+			m_Size = size;
+
+			for (size_t i{}; i < m_Size; ++i)
+			{
+				new (m_pData + i) T{};
+			}
+		}
+
+		void Free()
+		{
+			if (!m_pData) return;
+
+			::operator delete[](m_pData, std::align_val_t{ Alignment });
+
+			m_pData = nullptr;
+			m_Size = 0;
+		}
+
+		T* Data() { return m_pData; }
+		const T* Data() const { return m_pData; }
+
+		size_t Size() const { return m_Size; }
+		bool IsEmpty() const { return m_Size == 0; }
+
+		T& operator[](size_t index)
+		{
+			assert(index < m_Size);
+			return m_pData[index];
+		}
+
+		const T& operator[](size_t index) const
+		{
+			assert(index < m_Size);
+			return m_pData[index];
+		}
+
+	private:
+		T* m_pData{};
+		size_t m_Size{};
+	};
+}
@@ -3,6 +3,11 @@
 
 #include "Math.h"
 #include "vector"
+#include <cstdint>
+#include <algorithm>
+
+#include "AlignedBuffer.h"
+#include "ThreadPool.h"
 
 namespace dae
 {
@@ -15,6 +20,54 @@ namespace dae
 		unsigned char materialIndex{ 0 };
 	};
 
+	//Spheres stored per component so the SIMD kernels can test 8 of them with one load per component
+	struct SphereSoA
+	{
+		//the buffers are padded so a SIMD kernel can always load this many spheres starting at any valid one
+		static constexpr size_t maxSIMDWidth{ 8 };
+
+		AlignedBuffer<float> originX{}, originY{}, originZ{};
+		AlignedBuffer<float> radiusSquared{};
+		AlignedBuffer<unsigned char> materialIndex{};
+
+		size_t count{};
+
+		void Resize(size_t sphereCount)
+		{
+			if (sphereCount == count) return;
+
+			for (AlignedBuffer<float>* pComponent : { &originX, &originY, &originZ, &radiusSquared })
+			{
+				pComponent->Allocate(sphereCount + maxSIMDWidth - 1);
+			}
+
+			materialIndex.Allocate(sphereCount + maxSIMDWidth - 1);
+
+			count = sphereCount;
+		}
+
+		void Set(size_t sphereIdx, const Sphere& sphere)
+		{
+			originX[sphereIdx] = sphere.origin.x;
+			originY[sphereIdx] = sphere.origin.y;
+			originZ[sphereIdx] = sphere.origin.z;
+			radiusSquared[sphereIdx] = sphere.radius * sphere.radius;
+			materialIndex[sphereIdx] = sphere.materialIndex;
+		}
+
+		Vector3 GetOrigin(size_t sphereIdx) const { return { originX[sphereIdx], originY[sphereIdx], originZ[sphereIdx] }; }
+	};
+
+	//Range of SphereSoA entries that the top level BVH treats as one primitive
+	struct SphereGroup
+	{
+		//one AVX test covers a whole group
+		static constexpr size_t maxSize{ 8 };
+
+		size_t firstSphere{};
+		size_t sphereCount{};
+	};
+
 	struct Plane
 	{
 		Vector3 origin{};
@@ -57,17 +110,36 @@ namespace dae
 		unsigned char materialIndex{};
 	};
 
+	//32 bytes so two nodes share a cache line, leftFirst is the left child for interior nodes and the first indice for leaves
 	struct BVHNode
 	{
 		Vector3 minAABB{};
+		uint32_t leftFirst{};
 		Vector3 maxAABB{};
-		size_t leftNode{}, firstIndice{}, IndiceCount{};
+		uint32_t IndiceCount{};
 		bool IsLeaf() const { return IndiceCount > 0; }
 	};
 
+	static_assert(sizeof(BVHNode) == 32, "BVHNode should stay 32 bytes");
+
+	//Collapsed node with 4 children, the bounds are stored per axis so one SSE slab test checks all children at once
+	struct alignas(64) BVH4Node
+	{
+		static constexpr uint32_t EmptyChild{ UINT32_MAX };
+
+		float minX[4]{}, minY[4]{}, minZ[4]{};
+		float maxX[4]{}, maxY[4]{}, maxZ[4]{};
+
+		//interior child: index of its BVH4Node, leaf child: first indice
+		uint32_t child[4]{ EmptyChild, EmptyChild, EmptyChild, EmptyChild };
+
+		//indice count of leaf children, 0 for interior ones
+		uint32_t count[4]{};
+	};
+
 	struct AABB
 	{
-		Vector3 min{ Vector3::Identity * FLT_MAX }, max{ Vector3::Identity * FLT_MIN };
+		Vector3 min{ Vector3::Identity * FLT_MAX }, max{ Vector3::Identity * -FLT_MAX };
 
 		void Grow(const Vector3& p)
 		{ 
@@ -95,6 +167,95 @@ namespace dae
 		int indiceCount{};
 	};
 
+	enum class TLASPrimitiveType : unsigned char
+	{
+		SphereGroup,
+		TriangleMesh,
+		TriangleMeshInstance
+	};
+
+	//Reference to one bounded object in the scene, the top level BVH sorts these instead of the objects themselves
+	struct TLASPrimitive
+	{
+		AABB bounds{};
+		Vector3 center{};
+
+		TLASPrimitiveType type{};
+		size_t index{};
+	};
+
+	struct TLASNode
+	{
+		Vector3 minAABB{};
+		Vector3 maxAABB{};
+		size_t leftNode{}, firstPrimitive{}, primitiveCount{};
+		bool IsLeaf() const { return primitiveCount > 0; }
+	};
+
+	//Node of the light BVH, power is the summed power of the point lights below it
+	struct LightBVHNode
+	{
+		Vector3 minAABB{};
+		Vector3 maxAABB{};
+		float power{};
+		size_t leftNode{}, firstLight{}, lightCount{};
+		bool IsLeaf() const { return lightCount > 0; }
+	};
+
+	//Transformed triangles of a mesh with their Moller-Trumbore edges already computed, stored per component
+	//triangle i is the one whose indices start at i * 3, so the triangles of a BVH leaf are one contiguous range
+	struct TriangleSoA
+	{
+		//the buffers are padded so a SIMD kernel can always load this many triangles starting at any valid one
+		static constexpr size_t maxSIMDWidth{ 8 };
+
+		AlignedBuffer<float> v0X{}, v0Y{}, v0Z{};
+		AlignedBuffer<float> edge1X{}, edge1Y{}, edge1Z{};
+		AlignedBuffer<float> edge2X{}, edge2Y{}, edge2Z{};
+		AlignedBuffer<float> normalX{}, normalY{}, normalZ{};
+
+		size_t count{};
+
+		void Resize(size_t triangleCount)
+		{
+			if (triangleCount == count) return;
+
+			for (AlignedBuffer<float>* pComponent : { &v0X, &v0Y, &v0Z, &edge1X, &edge1Y, &edge1Z, &edge2X, &edge2Y, &edge2Z, &normalX, &normalY, &normalZ })
+			{
+				pComponent->Allocate(triangleCount + maxSIMDWidth - 1);
+			}
+
+			count = triangleCount;
+		}
+
+		void Set(size_t triangleIdx, const Vector3& v0, const Vector3& v1, const Vector3& v2, const Vector3& normal)
+		{
+			const Vector3 edge1{ v1 - v0 };
+			const Vector3 edge2{ v2 - v0 };
+
+			v0X[triangleIdx] = v0.x;
+			v0Y[triangleIdx] = v0.y;
+			v0Z[triangleIdx] = v0.z;
+
+			edge1X[triangleIdx] = edge1.x;
+			edge1Y[triangleIdx] = edge1.y;
+			edge1Z[triangleIdx] = edge1.z;
+
+			edge2X[triangleIdx] = edge2.x;
+			edge2Y[triangleIdx] = edge2.y;
+			edge2Z[triangleIdx] = edge2.z;
+
+			normalX[triangleIdx] = normal.x;
+			normalY[triangleIdx] = normal.y;
+			normalZ[triangleIdx] = normal.z;
+		}
+
+		Vector3 GetV0(size_t triangleIdx) const { return { v0X[triangleIdx], v0Y[triangleIdx], v0Z[triangleIdx] }; }
+		Vector3 GetEdge1(size_t triangleIdx) const { return { edge1X[triangleIdx], edge1Y[triangleIdx], edge1Z[triangleIdx] }; }
+		Vector3 GetEdge2(size_t triangleIdx) const { return { edge2X[triangleIdx], edge2Y[triangleIdx], edge2Z[triangleIdx] }; }
+		Vector3 GetNormal(size_t triangleIdx) const { return { normalX[triangleIdx], normalY[triangleIdx], normalZ[triangleIdx] }; }
+	};
+
 	struct TriangleMesh
 	{
 		TriangleMesh() = default;
@@ -105,12 +266,14 @@ namespace dae
 			CalculateNormals();
 
 			//Update Transforms
+			UpdateAABB();
 			UpdateTransforms();
 		}
 
 		TriangleMesh(const std::vector<Vector3>& _positions, const std::vector<int>& _indices, const std::vector<Vector3>& _normals, TriangleCullMode _cullMode) :
 			positions(_positions), indices(_indices), normals(_normals), cullMode(_cullMode)
 		{
+			UpdateAABB();
 			UpdateTransforms();
 		}
 
@@ -134,38 +297,224 @@ namespace dae
 		std::vector<Vector3> transformedPositions{};
 		std::vector<Vector3> transformedNormals{};
 
-		BVHNode* pBVHNode{};
+		//what the hit tests read, rebuilt from the transformed vertices whenever they or the triangle order change
+		TriangleSoA triangles{};
+
+		AlignedBuffer<BVHNode> bvhNodes{};
+
+		//traversal copy of the binary tree, rebuilt from it after every build or refit
+		std::vector<BVH4Node> wideBVHNodes{};
 
 		size_t rootNodeIdx{};
 		size_t nodesUsed{};
 
-		~TriangleMesh()
-		{
-			delete[] pBVHNode;
-		}
+		//SAH cost of the tree right after the last full build, refits are compared against it
+		float builtSAHCost{};
+
+		//a refit tree that got this much more expensive than the built one gets rebuilt
+		static constexpr float maxRefitSAHCostRatio{ 1.5f };
+
+		//triangles the widest hit test kernel takes at once, the scene sets it from the SIMD level when it adds the mesh
+		//nodes get split until they fit one packet or splitting stops paying off, the SAH counts whole packets since a packet costs the same however many lanes it fills
+		size_t packetWidth{ 4 };
+
+		//loops over fewer vertices or triangles than this aren't worth waking the thread pool for
+		static constexpr size_t minParallelItems{ 4096 };
+
+		bool HasBVH() const { return nodesUsed > 0; }
 
 		void BuildBVH()
 		{
+			if (indices.empty()) return;
+
+			//a binary tree with N triangle leaves never needs more than 2N - 1 nodes
+			bvhNodes.Allocate(indices.size() / 3 * 2 - 1);
+
 			//initialize root tree
-			nodesUsed = 0;
-			BVHNode& root = pBVHNode[rootNodeIdx];
-			root.leftNode = 0;
-			root.firstIndice = 0;
-			root.IndiceCount = static_cast<size_t>(indices.size());
+			rootNodeIdx = 0;
+			nodesUsed = 1;
+			BVHNode& root = bvhNodes[rootNodeIdx];
+			root.leftFirst = 0;
+			root.IndiceCount = static_cast<uint32_t>(indices.size());
 
 			UpdateBVHNodeBounds(rootNodeIdx);
 
 			Subdivide(rootNodeIdx);
+
+			//only keep the nodes that got used
+			AlignedBuffer<BVHNode> usedNodes{ nodesUsed };
+			std::copy_n(bvhNodes.Data(), nodesUsed, usedNodes.Data());
+			bvhNodes = std::move(usedNodes);
+
+			builtSAHCost = CalculateSAHCost();
+
+			CollapseBVH4();
+
+			//the build reordered the triangles, keep them in leaf order
+			UpdateTriangleSoA();
+		}
+
+		//Keeps the tree topology and only recomputes the node bounds, meant for meshes whose vertices moved
+		void RefitBVH()
+		{
+			//childnodes are always created after their parent, so walking backwards handles them first
+			for (size_t nodeIdx{ nodesUsed }; nodeIdx-- > 0;)
+			{
+				BVHNode& node{ bvhNodes[nodeIdx] };
+
+				if (node.IsLeaf())
+				{
+					UpdateBVHNodeBounds(nodeIdx);
+					continue;
+				}
+
+				const BVHNode& leftChild{ bvhNodes[node.leftFirst] };
+				const BVHNode& rightChild{ bvhNodes[node.leftFirst + 1] };
+
+				node.minAABB = Vector3::Min(leftChild.minAABB, rightChild.minAABB);
+				node.maxAABB = Vector3::Max(leftChild.maxAABB, rightChild.maxAABB);
+			}
+
+			CollapseBVH4();
+		}
+
+		void CollapseBVH4()
+		{
+			wideBVHNodes.clear();
+
+			//a 4 wide tree never has more nodes than the binary tree has interior nodes
+			wideBVHNodes.reserve(nodesUsed);
+			wideBVHNodes.emplace_back();
+
+			CollapseBVH4Node(rootNodeIdx, 0);
+		}
+
+		void CollapseBVH4Node(size_t nodeIdx, size_t wideNodeIdx)
+		{
+			const BVHNode& node{ bvhNodes[nodeIdx] };
+
+			size_t children[4]{};
+			int childCount{};
+
+			if (node.IsLeaf())
+			{
+				//only happens for a root that never got split
+				children[childCount++] = nodeIdx;
+			}
+			else
+			{
+				children[childCount++] = node.leftFirst;
+				children[childCount++] = node.leftFirst + 1;
+
+				//keep opening the biggest interior child until all 4 slots are used
+				while (childCount < 4)
+				{
+					int openIdx{ -1 };
+					float openArea{ -1.f };
+
+					for (int i{}; i < childCount; ++i)
+					{
+						const BVHNode& child{ bvhNodes[children[i]] };
+
+						if (child.IsLeaf()) continue;
+
+						const float area{ CalculateNodeArea(child) };
+
+						if (area > openArea)
+						{
+							openArea = area;
+							openIdx = i;
+						}
+					}
+
+					if (openIdx < 0) break;
+
+					const size_t openedNodeIdx{ children[openIdx] };
+
+					children[openIdx] = bvhNodes[openedNodeIdx].leftFirst;
+					children[childCount++] = bvhNodes[openedNodeIdx].leftFirst + 1;
+				}
+			}
+
+			for (int i{}; i < childCount; ++i)
+			{
+				const BVHNode& child{ bvhNodes[children[i]] };
+
+				//looked up again every iteration, the recursion below adds nodes
+				BVH4Node& wideNode{ wideBVHNodes[wideNodeIdx] };
+
+				wideNode.minX[i] = child.minAABB.x;
+				wideNode.minY[i] = child.minAABB.y;
+				wideNode.minZ[i] = child.minAABB.z;
+				wideNode.maxX[i] = child.maxAABB.x;
+				wideNode.maxY[i] = child.maxAABB.y;
+				wideNode.maxZ[i] = child.maxAABB.z;
+
+				if (child.IsLeaf())
+				{
+					wideNode.child[i] = child.leftFirst;
+					wideNode.count[i] = child.IndiceCount;
+				}
+				else
+				{
+					const size_t childWideNodeIdx{ wideBVHNodes.size() };
+
+					wideNode.child[i] = static_cast<uint32_t>(childWideNodeIdx);
+					wideNode.count[i] = 0;
+
+					wideBVHNodes.emplace_back();
+
+					CollapseBVH4Node(children[i], childWideNodeIdx);
+				}
+			}
+		}
+
+		//Refits the tree and only falls back to a full build once the refit quality dropped too far
+		void UpdateBVH()
+		{
+			if (!HasBVH())
+			{
+				BuildBVH();
+				return;
+			}
+
+			RefitBVH();
+
+			if (CalculateSAHCost() > builtSAHCost * maxRefitSAHCostRatio)
+			{
+				BuildBVH();
+			}
+		}
+
+		//Expected cost of a random ray through the tree, relative to the root so rotating meshes stay comparable
+		float CalculateSAHCost() const
+		{
+			const float rootArea{ CalculateNodeArea(bvhNodes[rootNodeIdx]) };
+
+			if (rootArea <= 0.f) return 0.f;
+
+			float cost{};
+
+			for (size_t nodeIdx{}; nodeIdx < nodesUsed; ++nodeIdx)
+			{
+				const BVHNode& node{ bvhNodes[nodeIdx] };
+
+				const float nodeCost{ node.IsLeaf() ? GetPacketCount(node.IndiceCount) : 1.f };
+
+				cost += CalculateNodeArea(node) * nodeCost;
+			}
+
+			return cost / rootArea;
 		}
 
 		void UpdateBVHNodeBounds(size_t nodeIdx)
 		{
-			BVHNode& node{ pBVHNode[nodeIdx] };
+			BVHNode& node{ bvhNodes[nodeIdx] };
 
 			node.minAABB = Vector3::Identity * FLT_MAX;
-			node.maxAABB = Vector3::Identity * FLT_MIN;
+			node.maxAABB = Vector3::Identity * -FLT_MAX;
 
-			for (size_t i {node.firstIndice}; i < node.firstIndice + node.IndiceCount; ++i)
+			for (size_t i {node.leftFirst}; i < node.leftFirst + node.IndiceCount; ++i)
 			{
 				const Vector3& curVertex{ transformedPositions[indices[i]] };
 
@@ -174,110 +523,151 @@ namespace dae
 			}
 		}
 
-		inline float FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos)
+		inline float FindBestSplitPlane(const BVHNode& node, int& axis, float& splitPos) const
 		{
+			float axisCosts[3]{ FLT_MAX, FLT_MAX, FLT_MAX };
+			float axisSplitPositions[3]{};
 
-			float bestCost{ FLT_MAX };
+			const auto binAxes = [&](size_t firstAxis, size_t endAxis)
+				{
+					for (size_t a{ firstAxis }; a < endAxis; ++a)
+					{
+						axisCosts[a] = FindBestSplitPlaneOnAxis(node, static_cast<int>(a), axisSplitPositions[a]);
+					}
+				};
 
-			for (int a = 0; a < 3; ++a)
+			//big nodes bin their axes on separate threads, picking the best afterwards gives the same split as doing them in order
+			if (node.IndiceCount / 3 >= minParallelItems)
 			{
+				ThreadPool::GetShared().ParallelFor(3, 1, binAxes);
+			}
+			else
+			{
+				binAxes(0, 3);
+			}
 
-				float boundsMin{ FLT_MAX };
-				float boundsMax{ FLT_MIN };
+			float bestCost{ FLT_MAX };
 
-				for (size_t i{}; i < node.IndiceCount; i += 3)
+			for (int a{}; a < 3; ++a)
+			{
+				if (axisCosts[a] < bestCost)
 				{
-					const size_t indicePlusI{ node.firstIndice + i };
+					bestCost = axisCosts[a];
+					axis = a;
+					splitPos = axisSplitPositions[a];
+				}
+			}
 
-					const Vector3 center{ (transformedPositions[indices[indicePlusI]] + transformedPositions[indices[indicePlusI + 1]] + transformedPositions[indices[indicePlusI + 2]]) / 3 };
+			return bestCost;
+		}
 
-					boundsMin = std::min(center[a], boundsMin);
-					boundsMax = std::max(center[a], boundsMax);
-				}
+		//SAH cost of the best of the binned split planes along axis a, FLT_MAX when the centers don't spread along it
+		inline float FindBestSplitPlaneOnAxis(const BVHNode& node, int a, float& splitPos) const
+		{
+			float bestCost{ FLT_MAX };
 
-				if (AreEqual(boundsMin, boundsMax)) continue;
+			float boundsMin{ FLT_MAX };
+			float boundsMax{ -FLT_MAX };
 
-				const int nrOfBins{ 8 };
+			for (size_t i{}; i < node.IndiceCount; i += 3)
+			{
+				const size_t indicePlusI{ node.leftFirst + i };
 
-				const int binsMin1{ nrOfBins - 1 };
+				const Vector3 center{ (transformedPositions[indices[indicePlusI]] + transformedPositions[indices[indicePlusI + 1]] + transformedPositions[indices[indicePlusI + 2]]) / 3 };
 
-				BIN bins[nrOfBins];
+				boundsMin = std::min(center[a], boundsMin);
+				boundsMax = std::max(center[a], boundsMax);
+			}
 
-				float scale{ nrOfBins / (boundsMax - boundsMin) };
+			if (AreEqual(boundsMin, boundsMax)) return bestCost;
 
-				for (size_t i{}; i < node.IndiceCount; i += 3)
-				{
+			const int nrOfBins{ 8 };
 
-					const size_t indicePlusI{ node.firstIndice + i };
+			const int binsMin1{ nrOfBins - 1 };
 
-					const Vector3& v0{ transformedPositions[indices[indicePlusI]] };
-					const Vector3& v1{ transformedPositions[indices[indicePlusI + 1]] };
-					const Vector3& v2{ transformedPositions[indices[indicePlusI + 2]] };
+			BIN bins[nrOfBins];
 
-					const Vector3 center{ (v0 + v1 + v2) / 3 };
+			float scale{ nrOfBins / (boundsMax - boundsMin) };
 
-					const int binIdx{ std::min(binsMin1, static_cast<int>((center[a] - boundsMin) * scale)) };
+			for (size_t i{}; i < node.IndiceCount; i += 3)
+			{
 
-					bins[binIdx].indiceCount += 3;
-					bins[binIdx].bounds.Grow(v0);
-					bins[binIdx].bounds.Grow(v1);
-					bins[binIdx].bounds.Grow(v2);
-				}
+				const size_t indicePlusI{ node.leftFirst + i };
 
-				float leftArea[binsMin1]{}, rightArea[binsMin1]{};
-				int leftCount[binsMin1]{}, rightCount[binsMin1]{};
-				AABB leftBox, rightBox;
-				int leftSum = 0, rightSum = 0;
+				const Vector3& v0{ transformedPositions[indices[indicePlusI]] };
+				const Vector3& v1{ transformedPositions[indices[indicePlusI + 1]] };
+				const Vector3& v2{ transformedPositions[indices[indicePlusI + 2]] };
 
-				for (size_t i{}; i < binsMin1; ++i)
-				{
-					leftSum += bins[i].indiceCount;
-					leftCount[i] = leftSum;
-					leftBox.Grow(bins[i].bounds);
-					leftArea[i] = leftBox.Area();
-
-					const size_t nrBins1minI{ binsMin1 - i };
-					const size_t nrBins2minI{ nrBins1minI - 1 };
-
-					rightSum += bins[nrBins1minI].indiceCount;
-					rightCount[nrBins2minI] = rightSum;
-					rightBox.Grow(bins[nrBins1minI].bounds);
-					rightArea[nrBins2minI] = rightBox.Area();
-				}
+				const Vector3 center{ (v0 + v1 + v2) / 3 };
 
-				scale = (boundsMax - boundsMin) / nrOfBins;
+				const int binIdx{ std::min(binsMin1, static_cast<int>((center[a] - boundsMin) * scale)) };
 
-				for (size_t i{}; i < binsMin1; ++i)
-				{
-					const float planeCost{ leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i] };
+				bins[binIdx].indiceCount += 3;
+				bins[binIdx].bounds.Grow(v0);
+				bins[binIdx].bounds.Grow(v1);
+				bins[binIdx].bounds.Grow(v2);
+			}
 
-					if (planeCost < bestCost)
-					{
-						axis = a;
-						splitPos = boundsMin + scale * (i + 1);
-						bestCost = planeCost;
-					}
+			float leftArea[binsMin1]{}, rightArea[binsMin1]{};
+			int leftCount[binsMin1]{}, rightCount[binsMin1]{};
+			AABB leftBox, rightBox;
+			int leftSum = 0, rightSum = 0;
+
+			for (size_t i{}; i < binsMin1; ++i)
+			{
+				leftSum += bins[i].indiceCount;
+				leftCount[i] = leftSum;
+				leftBox.Grow(bins[i].bounds);
+				leftArea[i] = leftBox.Area();
+
+				const size_t nrBins1minI{ binsMin1 - i };
+				const size_t nrBins2minI{ nrBins1minI - 1 };
+
+				rightSum += bins[nrBins1minI].indiceCount;
+				rightCount[nrBins2minI] = rightSum;
+				rightBox.Grow(bins[nrBins1minI].bounds);
+				rightArea[nrBins2minI] = rightBox.Area();
+			}
+
+			scale = (boundsMax - boundsMin) / nrOfBins;
 
+			for (size_t i{}; i < binsMin1; ++i)
+			{
+				const float planeCost{ GetPacketCount(leftCount[i]) * leftArea[i] + GetPacketCount(rightCount[i]) * rightArea[i] };
+
+				if (planeCost < bestCost)
+				{
+					splitPos = boundsMin + scale * (i + 1);
+					bestCost = planeCost;
 				}
 
 			}
 
 			return bestCost;
-
 		}
 
 		float CalculateNodeCost(BVHNode& node)
+		{
+			return GetPacketCount(node.IndiceCount) * CalculateNodeArea(node);
+		}
+
+		//Packets of packetWidth triangles it takes to test indiceCount indices, rounded up
+		float GetPacketCount(size_t indiceCount) const
+		{
+			return static_cast<float>((indiceCount / 3 + packetWidth - 1) / packetWidth);
+		}
+
+		static float CalculateNodeArea(const BVHNode& node)
 		{
 			const Vector3 e = node.maxAABB - node.minAABB; // extent of the node
-			const float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
-			return node.IndiceCount * surfaceArea;
+			return e.x * e.y + e.y * e.z + e.z * e.x;
 		}
 
 		void Subdivide(size_t nodeIdx)
 		{
-			BVHNode& node{ pBVHNode[nodeIdx] };
+			BVHNode& node{ bvhNodes[nodeIdx] };
 			
-			if (node.IndiceCount <= 6) return;
+			if (node.IndiceCount <= packetWidth * 3) return;
 
 			//determine split axis using SAH
 
@@ -289,13 +679,13 @@ namespace dae
 
 			if (noSplitCost <  cost) return;
 
-			//in place partition
+			//in place partition, end is exclusive so it can't wrap around when everything moves right
 
-			size_t i { (node.firstIndice) };
-			size_t j { i + (node.IndiceCount) - 1 };
+			size_t i { (node.leftFirst) };
+			size_t end { i + (node.IndiceCount) };
 
 
-			while(i <= j)
+			while(i < end)
 			{
 
 				const Vector3 center{ (transformedPositions[indices[i]] + transformedPositions[indices[i + 1]] + transformedPositions[indices[i + 2]]) / 3 };
@@ -306,25 +696,15 @@ namespace dae
 				}
 				else
 				{
+					end -= 3;
 
-					const size_t jMinus2{ j - 2 };
-					const size_t jMinus2Divide3{ jMinus2 / 3 };
-
-					const size_t iDivide3{ i / 3 };
-
-					std::swap(indices[i], indices[jMinus2]);
-					std::swap(indices[i + 1], indices[j - 1]);
-					std::swap(indices[i + 2], indices[j]);
-					std::swap(normals[iDivide3], normals[jMinus2Divide3]);
-					std::swap(transformedNormals[iDivide3], transformedNormals[jMinus2Divide3]);
-
-					j -= 3;
+					SwapTriangles(i, end);
 				}
 
 			}
 			//abort split if one of the sides is empty
 
-			const size_t leftCount { i - node.firstIndice };
+			const size_t leftCount { i - node.leftFirst };
 
 			if (leftCount == 0 || leftCount == node.IndiceCount)
 			{
@@ -332,15 +712,15 @@ namespace dae
 			}
 
 			//create childnodes
-			const size_t leftChildIdx{ ++nodesUsed };
-			const size_t rightChildIdx{++nodesUsed};
+			const size_t leftChildIdx{ nodesUsed++ };
+			const size_t rightChildIdx{ nodesUsed++ };
 
-			node.leftNode = leftChildIdx;
+			bvhNodes[leftChildIdx].leftFirst = node.leftFirst;
+			bvhNodes[leftChildIdx].IndiceCount = static_cast<uint32_t>(leftCount);
+			bvhNodes[rightChildIdx].leftFirst = static_cast<uint32_t>(i);
+			bvhNodes[rightChildIdx].IndiceCount = node.IndiceCount - static_cast<uint32_t>(leftCount);
 
-			pBVHNode[leftChildIdx].firstIndice = node.firstIndice;
-			pBVHNode[leftChildIdx].IndiceCount = leftCount;
-			pBVHNode[rightChildIdx].firstIndice = i;
-			pBVHNode[rightChildIdx].IndiceCount = node.IndiceCount - leftCount;
+			node.leftFirst = static_cast<uint32_t>(leftChildIdx);
 
 			node.IndiceCount = 0;
 
@@ -352,6 +732,20 @@ namespace dae
 			Subdivide(rightChildIdx);
 		}
 
+		//Swaps two triangles given the index of their first indice, the per triangle normals follow the indices
+		void SwapTriangles(size_t a, size_t b)
+		{
+			std::swap(indices[a], indices[b]);
+			std::swap(indices[a + 1], indices[b + 1]);
+			std::swap(indices[a + 2], indices[b + 2]);
+
+			const size_t triangleA{ a / 3 };
+			const size_t triangleB{ b / 3 };
+
+			std::swap(normals[triangleA], normals[triangleB]);
+			std::swap(transformedNormals[triangleA], transformedNormals[triangleB]);
+		}
+
 		void Translate(const Vector3& translation)
 		{
 			translationTransform = Matrix::CreateTranslation(translation);
@@ -404,23 +798,48 @@ namespace dae
 			const Matrix SRT{ scaleTransform  * rotationTransform * translationTransform };
 			const Matrix normalRT{ rotationTransform * translationTransform };
 
-			transformedPositions.clear();
-			transformedPositions.reserve(positions.size());
+			transformedPositions.resize(positions.size());
 
-			for (int i{}; i < positions.size(); ++i)
-			{
-				transformedPositions.emplace_back(SRT.TransformPoint(positions[i]));
-			}
+			ThreadPool::GetShared().ParallelFor(positions.size(), minParallelItems, [&](size_t firstVertex, size_t endVertex)
+				{
+					for (size_t i{ firstVertex }; i < endVertex; ++i)
+					{
+						transformedPositions[i] = SRT.TransformPoint(positions[i]);
+					}
+				});
 
-			transformedNormals.clear();
-			transformedNormals.reserve(positions.size());
+			transformedNormals.resize(normals.size());
 
-			for (int i{}; i < normals.size(); ++i)
-			{
-				transformedNormals.emplace_back(normalRT.TransformVector(normals[i]));
-			}
+			ThreadPool::GetShared().ParallelFor(normals.size(), minParallelItems, [&](size_t firstNormal, size_t endNormal)
+				{
+					for (size_t i{ firstNormal }; i < endNormal; ++i)
+					{
+						transformedNormals[i] = normalRT.TransformVector(normals[i]);
+					}
+				});
 
 			UpdateTransformedAABB(SRT);
+
+			UpdateTriangleSoA();
+		}
+
+		void UpdateTriangleSoA()
+		{
+			triangles.Resize(indices.size() / 3);
+
+			ThreadPool::GetShared().ParallelFor(triangles.count, minParallelItems, [this](size_t firstTriangle, size_t endTriangle)
+				{
+					for (size_t triangleIdx{ firstTriangle }; triangleIdx < endTriangle; ++triangleIdx)
+					{
+						const size_t indiceIdx{ triangleIdx * 3 };
+
+						triangles.Set(triangleIdx,
+							transformedPositions[indices[indiceIdx]],
+							transformedPositions[indices[indiceIdx + 1]],
+							transformedPositions[indices[indiceIdx + 2]],
+							transformedNormals[triangleIdx]);
+					}
+				});
 		}
 
 		void UpdateAABB()
@@ -439,6 +858,12 @@ namespace dae
 		}
 
 		void UpdateTransformedAABB(const Matrix& finalTransform)
+		{
+			TransformAABB(finalTransform, minAABB, maxAABB, transformedMinAABB, transformedMaxAABB);
+		}
+
+		//Transforms all 8 corners of the box and takes their bounds
+		static void TransformAABB(const Matrix& finalTransform, const Vector3& minAABB, const Vector3& maxAABB, Vector3& transformedMinAABB, Vector3& transformedMaxAABB)
 		{
 
 			Vector3 tMinAABB = finalTransform.TransformPoint(minAABB);
@@ -477,6 +902,53 @@ namespace dae
 
 		}
 	};
+
+	//Places a shared TriangleMesh in the world, rays get moved into the object space of the mesh instead of the vertices into world space
+	//so the mesh and its BVH are built once and can be shared by any number of instances
+	struct TriangleMeshInstance
+	{
+		const TriangleMesh* pMesh{};
+
+		TriangleCullMode cullMode{ TriangleCullMode::BackFaceCulling };
+		unsigned char materialIndex{};
+
+		Matrix rotationTransform{};
+		Matrix translationTransform{};
+		Matrix scaleTransform{};
+
+		Matrix worldToObject{};
+
+		//inverse transpose of the object to world matrix, keeps normals perpendicular under non uniform scale
+		Matrix normalToWorld{};
+
+		Vector3 transformedMinAABB{};
+		Vector3 transformedMaxAABB{};
+
+		void Translate(const Vector3& translation)
+		{
+			translationTransform = Matrix::CreateTranslation(translation);
+		}
+
+		void RotateY(const float yaw)
+		{
+			rotationTransform = Matrix::CreateRotationY(yaw);
+		}
+
+		void Scale(const Vector3& scale)
+		{
+			scaleTransform = Matrix::CreateScale(scale);
+		}
+
+		void UpdateTransforms()
+		{
+			const Matrix SRT{ scaleTransform * rotationTransform * translationTransform };
+
+			worldToObject = Matrix::Inverse(SRT);
+			normalToWorld = Matrix::Transpose(worldToObject);
+
+			TriangleMesh::TransformAABB(SRT, pMesh->transformedMinAABB, pMesh->transformedMaxAABB, transformedMinAABB, transformedMaxAABB);
+		}
+	};
 #pragma endregion
 #pragma region LIGHT
 	enum class LightType
@@ -492,7 +964,13 @@ namespace dae
 		ColorRGB color{};
 		float intensity{};
 
+		//distance past which the radiance of a point light is negligible, FLT_MAX means it reaches everything
+		float influenceRadius{ FLT_MAX };
+
 		LightType type{};
+
+		//position in Scene::GetLights(), the culled and sampled copies keep it so per light caches stay keyed by the scene light
+		uint32_t sceneIndex{};
 	};
 #pragma endregion
 #pragma region MISC
@@ -507,6 +985,59 @@ namespace dae
 		Vector3 inverseDirection{1/direction.x, 1 / direction.y , 1 / direction.z };
 	};
 
+	//2x2 block of neighbouring rays that get traced through the BVHs together
+	struct RayPacket
+	{
+		static constexpr int Size{ 4 };
+
+		Ray rays[Size]{};
+
+		//Rays heading into the same octant agree on which child of a node is the near one
+		bool IsCoherent() const
+		{
+			for (int lane{ 1 }; lane < Size; ++lane)
+			{
+				if ((rays[lane].direction.x < 0) != (rays[0].direction.x < 0)) return false;
+				if ((rays[lane].direction.y < 0) != (rays[0].direction.y < 0)) return false;
+				if ((rays[lane].direction.z < 0) != (rays[0].direction.z < 0)) return false;
+			}
+
+			return true;
+		}
+	};
+
+	enum class HitPrimitiveType : unsigned char
+	{
+		None,
+		Plane,
+		Sphere,
+		Triangle
+	};
+
+	//What traversal keeps of the closest hit so far, just enough to compare hits and to rebuild the winner
+	//the position and normal only get computed once, for the final closest hit
+	struct HitCandidate
+	{
+		float t{ FLT_MAX };
+
+		//barycentrics of triangle hits
+		float u{};
+		float v{};
+
+		//plane index, index in the SphereSoA or triangle index in pMesh
+		uint32_t primitiveIdx{};
+
+		const TriangleMesh* pMesh{};
+
+		//set when pMesh got hit through an instance, the hit then still has to go to world space
+		const TriangleMeshInstance* pInstance{};
+
+		HitPrimitiveType type{ HitPrimitiveType::None };
+		unsigned char materialIndex{};
+
+		bool DidHit() const { return type != HitPrimitiveType::None; }
+	};
+
 	struct HitRecord
 	{
 		Vector3 origin{};
@@ -5,7 +5,21 @@
 
 namespace dae
 {
+	struct MaterialTable;
+
+	enum class MaterialKind : uint8_t
+	{
+		SolidColor,
+		Lambert,
+		LambertPhong,
+		CookTorrence,
+	};
+
+	constexpr size_t MaterialKindCount{ 4 };
+
 #pragma region Material BASE
+	//Describes a material while a scene gets built, the scene copies its parameters into its MaterialTable
+	//shading only goes through that table, each kind has a static Shade that works on its Parameters
 	class Material
 	{
 	public:
@@ -17,14 +31,8 @@ namespace dae
 		Material& operator=(const Material&) = delete;
 		Material& operator=(Material&&) noexcept = delete;
 
-		/**
-		 * \brief Function used to calculate the correct color for the specific material and its parameters
-		 * \param hitRecord current hitrecord
-		 * \param l light direction
-		 * \param v view direction
-		 * \return color
-		 */
-		virtual ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) = 0;
+		//Adds the parameters of the material to the table of its kind
+		virtual void AddTo(MaterialTable& table) const = 0;
 	};
 #pragma endregion
 
@@ -34,17 +42,32 @@ namespace dae
 	class Material_SolidColor final : public Material
 	{
 	public:
-		Material_SolidColor(const ColorRGB& color): m_Color(color)
+		struct Parameters
+		{
+			ColorRGB color{colors::White};
+		};
+
+		Material_SolidColor(const ColorRGB& color): m_Parameters{ color }
 		{
 		}
 
-		ColorRGB Shade(const HitRecord& hitRecord, const Vector3& l, const Vector3& v) override
+		void AddTo(MaterialTable& table) const override;
+
+		/**
+		 * \brief Function used to calculate the correct color for the specific material and its parameters
+		 * \param parameters parameters of the material
+		 * \param hitRecord current hitrecord
+		 * \param l light direction
+		 * \param v view direction
+		 * \return color
+		 */
+		static ColorRGB Shade(const Parameters& parameters, const HitRecord& hitRecord, const Vector3& l, const Vector3& v)
 		{
-			return m_Color;
+			return parameters.color;
 		}
 
 	private:
-		ColorRGB m_Color{colors::White};
+		Parameters m_Parameters{};
 	};
 #pragma endregion
 
@@ -54,17 +77,24 @@ namespace dae
 	class Material_Lambert final : public Material
 	{
 	public:
+		struct Parameters
+		{
+			ColorRGB diffuseColor{colors::White};
+			float diffuseReflectance{1.f}; //kd
+		};
+
 		Material_Lambert(const ColorRGB& diffuseColor, float diffuseReflectance) :
-			m_DiffuseColor(diffuseColor), m_DiffuseReflectance(diffuseReflectance){}
+			m_Parameters{ diffuseColor, diffuseReflectance }{}
 
-		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) override
+		void AddTo(MaterialTable& table) const override;
+
+		static ColorRGB Shade(const Parameters& parameters, const HitRecord& hitRecord, const Vector3& l, const Vector3& v)
 		{
-			return BRDF::Lambert(m_DiffuseReflectance,m_DiffuseColor);
+			return BRDF::Lambert(parameters.diffuseReflectance,parameters.diffuseColor);
 		}
 
 	private:
-		ColorRGB m_DiffuseColor{colors::White};
-		float m_DiffuseReflectance{1.f}; //kd
+		Parameters m_Parameters{};
 	};
 #pragma endregion
 
@@ -74,22 +104,28 @@ namespace dae
 	class Material_LambertPhong final : public Material
 	{
 	public:
+		struct Parameters
+		{
+			ColorRGB diffuseColor{colors::White};
+			float diffuseReflectance{0.5f}; //kd
+			float specularReflectance{0.5f}; //ks
+			float phongExponent{1.f}; //Phong Exponent
+		};
+
 		Material_LambertPhong(const ColorRGB& diffuseColor, float kd, float ks, float phongExponent):
-			m_DiffuseColor(diffuseColor), m_DiffuseReflectance(kd), m_SpecularReflectance(ks),
-			m_PhongExponent(phongExponent)
+			m_Parameters{ diffuseColor, kd, ks, phongExponent }
 		{
 		}
 
-		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) override
+		void AddTo(MaterialTable& table) const override;
+
+		static ColorRGB Shade(const Parameters& parameters, const HitRecord& hitRecord, const Vector3& l, const Vector3& v)
 		{
-			return BRDF::Lambert(m_DiffuseReflectance, m_DiffuseColor) + BRDF::Phong(m_SpecularReflectance, m_PhongExponent, l, -v, hitRecord.normal);
+			return BRDF::Lambert(parameters.diffuseReflectance, parameters.diffuseColor) + BRDF::Phong(parameters.specularReflectance, parameters.phongExponent, l, -v, hitRecord.normal);
 		}
 
 	private:
-		ColorRGB m_DiffuseColor{colors::White};
-		float m_DiffuseReflectance{0.5f}; //kd
-		float m_SpecularReflectance{0.5f}; //ks
-		float m_PhongExponent{1.f}; //Phong Exponent
+		Parameters m_Parameters{};
 	};
 #pragma endregion
 
@@ -98,43 +134,95 @@ namespace dae
 	class Material_CookTorrence final : public Material
 	{
 	public:
+		struct Parameters
+		{
+			ColorRGB albedo{0.955f, 0.637f, 0.538f}; //Copper
+			float metalness{1.0f};
+			float roughness{0.1f}; // [1.0 > 0.0] >> [ROUGH > SMOOTH]
+		};
+
 		Material_CookTorrence(const ColorRGB& albedo, float metalness, float roughness):
-			m_Albedo(albedo), m_Metalness(metalness), m_Roughness(roughness)
+			m_Parameters{ albedo, metalness, roughness }
 		{
 		}
 
-		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) override
+		void AddTo(MaterialTable& table) const override;
+
+		static ColorRGB Shade(const Parameters& parameters, const HitRecord& hitRecord, const Vector3& l, const Vector3& v)
 		{
 			//specular
-			ColorRGB f0{ m_Metalness <= FLT_EPSILON ? ColorRGB{ 0.04f, 0.04f, 0.04f } : m_Albedo };
+			ColorRGB f0{ parameters.metalness <= FLT_EPSILON ? ColorRGB{ 0.04f, 0.04f, 0.04f } : parameters.albedo };
 
 			Vector3 h{(v + l).Normalized()};
 
 			ColorRGB specular{
 
-				BRDF::NormalDistribution_GGX(hitRecord.normal,h, Square(m_Roughness)) * 
+				BRDF::NormalDistribution_GGX(hitRecord.normal,h, Square(parameters.roughness)) * 
 				BRDF::FresnelFunction_Schlick(h,v, f0) *
-				BRDF::GeometryFunction_Smith(hitRecord.normal,v,l, Square(m_Roughness))
+				BRDF::GeometryFunction_Smith(hitRecord.normal,v,l, Square(parameters.roughness))
 			};
 
 			specular /= (4 * Vector3::Dot(v, hitRecord.normal) * Vector3::Dot(l, hitRecord.normal));
 
 			//diffuse
-			const ColorRGB kd{ m_Metalness <= FLT_EPSILON ? ColorRGB(1,1,1) - BRDF::FresnelFunction_Schlick(h,v, f0) : ColorRGB(0,0,0) };
+			const ColorRGB kd{ parameters.metalness <= FLT_EPSILON ? ColorRGB(1,1,1) - BRDF::FresnelFunction_Schlick(h,v, f0) : ColorRGB(0,0,0) };
 
 
 			const ColorRGB diffuse
 			{
-				BRDF::Lambert(kd,m_Albedo)
+				BRDF::Lambert(kd,parameters.albedo)
 			};
 
 			return  diffuse + specular;
 		}
 
 	private:
-		ColorRGB m_Albedo{0.955f, 0.637f, 0.538f}; //Copper
-		float m_Metalness{1.0f};
-		float m_Roughness{0.1f}; // [1.0 > 0.0] >> [ROUGH > SMOOTH]
+		Parameters m_Parameters{};
 	};
 #pragma endregion
+
+#pragma region Material TABLE
+	//Every material of a scene, indexed like HitRecord::materialIndex
+	//the parameters of each kind sit in an array of their own, shading switches on the kind once per hit
+	//and then calls the Shade of that kind directly for all the lights
+	struct MaterialTable
+	{
+		std::vector<MaterialKind> kinds{};
+		//index into the parameter array of the material's kind
+		std::vector<uint32_t> parameterIndices{};
+
+		std::vector<Material_SolidColor::Parameters> solidColors{};
+		std::vector<Material_Lambert::Parameters> lamberts{};
+		std::vector<Material_LambertPhong::Parameters> lambertPhongs{};
+		std::vector<Material_CookTorrence::Parameters> cookTorrences{};
+
+		template<typename ParametersType>
+		void Add(MaterialKind kind, std::vector<ParametersType>& parameterArray, const ParametersType& parameters)
+		{
+			kinds.push_back(kind);
+			parameterIndices.push_back(static_cast<uint32_t>(parameterArray.size()));
+			parameterArray.push_back(parameters);
+		}
+	};
+
+	inline void Material_SolidColor::AddTo(MaterialTable& table) const
+	{
+		table.Add(MaterialKind::SolidColor, table.solidColors, m_Parameters);
+	}
+
+	inline void Material_Lambert::AddTo(MaterialTable& table) const
+	{
+		table.Add(MaterialKind::Lambert, table.lamberts, m_Parameters);
+	}
+
+	inline void Material_LambertPhong::AddTo(MaterialTable& table) const
+	{
+		table.Add(MaterialKind::LambertPhong, table.lambertPhongs, m_Parameters);
+	}
+
+	inline void Material_CookTorrence::AddTo(MaterialTable& table) const
+	{
+		table.Add(MaterialKind::CookTorrence, table.cookTorrences, m_Parameters);
+	}
+#pragma endregion
 }
@@ -82,6 +82,45 @@ namespace dae {
 		return out;
 	}
 
+	//Only valid for affine matrices (last column 0,0,0,1), which is all this raytracer builds
+	const Matrix& Matrix::Inverse()
+	{
+		const Vector3 xAxis{ data[0] };
+		const Vector3 yAxis{ data[1] };
+		const Vector3 zAxis{ data[2] };
+		const Vector3 t{ data[3] };
+
+		//columns of the inverted 3x3 part are the cross products of the other two rows
+		const Vector3 yCrossZ{ Vector3::Cross(yAxis, zAxis) };
+		const Vector3 zCrossX{ Vector3::Cross(zAxis, xAxis) };
+		const Vector3 xCrossY{ Vector3::Cross(xAxis, yAxis) };
+
+		const float determinant{ Vector3::Dot(xAxis, yCrossZ) };
+
+		assert(determinant != 0.f && "Matrix is not invertible");
+
+		const float invDeterminant{ 1.f / determinant };
+
+		const Vector3 invX{ Vector3{ yCrossZ.x, zCrossX.x, xCrossY.x } * invDeterminant };
+		const Vector3 invY{ Vector3{ yCrossZ.y, zCrossX.y, xCrossY.y } * invDeterminant };
+		const Vector3 invZ{ Vector3{ yCrossZ.z, zCrossX.z, xCrossY.z } * invDeterminant };
+
+		data[0] = { invX, 0 };
+		data[1] = { invY, 0 };
+		data[2] = { invZ, 0 };
+		data[3] = { -(invX * t.x + invY * t.y + invZ * t.z), 1 };
+
+		return *this;
+	}
+
+	Matrix Matrix::Inverse(const Matrix& m)
+	{
+		Matrix out{ m };
+		out.Inverse();
+
+		return out;
+	}
+
 	Vector3 Matrix::GetAxisX() const
 	{
 		return data[0];
@@ -224,5 +263,18 @@ namespace dae {
 
 		return *this;
 	}
+
+	bool Matrix::operator==(const Matrix& m) const
+	{
+		for (int r{ 0 }; r < 4; ++r)
+		{
+			for (int c{ 0 }; c < 4; ++c)
+			{
+				if (data[r][c] != m.data[r][c]) return false;
+			}
+		}
+
+		return true;
+	}
 #pragma endregion
 }
\ No newline at end of file
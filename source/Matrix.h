@@ -25,6 +25,7 @@ namespace dae {
 		Vector3 TransformPoint(const Vector3& p) const;
 		Vector3 TransformPoint(float x, float y, float z) const;
 		const Matrix& Transpose();
+		const Matrix& Inverse();
 
 		Vector3 GetAxisX() const;
 		Vector3 GetAxisY() const;
@@ -41,11 +42,13 @@ namespace dae {
 		static Matrix CreateScale(float sx, float sy, float sz);
 		static Matrix CreateScale(const Vector3& s);
 		static Matrix Transpose(const Matrix& m);
+		static Matrix Inverse(const Matrix& m);
 
 		Vector4& operator[](int index);
 		Vector4 operator[](int index) const;
 		Matrix operator*(const Matrix& m) const;
 		const Matrix& operator*=(const Matrix& m);
+		bool operator==(const Matrix& m) const;
 
 	private:
 
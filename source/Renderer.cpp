@@ -9,15 +9,48 @@
 #include "Material.h"
 #include "Scene.h"
 #include "Utils.h"
+#include "ThreadPool.h"
+#include <immintrin.h>
 #include <iostream>
-#include <thread>
-#include <future>
-#include <ppl.h>
 
 using namespace dae;
 
-//#define ASYNC
-#define PARAREL_FOR
+namespace dae
+{
+	//Traced hits of the 2x2 blocks of one tile, shading waits until the whole tile got traced
+	//so the hits can be shaded per material kind, every kind running through its own kernel
+	struct ShadingBatch
+	{
+		struct Block
+		{
+			//the many light mode shades every block with its own picks, kept in sampledLights starting at firstLight
+			bool isSampled{};
+			size_t firstLight{};
+			size_t lightCount{};
+			//the visibleLanes of the shadow rays of the block, one entry per shading light
+			size_t firstVisibility{};
+		};
+
+		struct Hit
+		{
+			HitRecord record{};
+			Vector3 viewDirection{};
+			uint32_t pixelIndex{};
+			uint32_t blockIdx{};
+			int lane{};
+		};
+
+		std::vector<Block> blocks{};
+		std::vector<Light> sampledLights{};
+		std::vector<uint8_t> visibleLanes{};
+
+		//indexed by MaterialKind
+		std::vector<Hit> buckets[MaterialKindCount]{};
+	};
+}
+
+#define TILED
+//#define PARAREL_FOR
 
 Renderer::Renderer(SDL_Window * pWindow) :
 	m_pWindow(pWindow),
@@ -25,11 +58,67 @@ Renderer::Renderer(SDL_Window * pWindow) :
 {
 	//Initialize
 	SDL_GetWindowSize(pWindow, &m_Width, &m_Height);
+
+	InitializeBuffers();
+}
+
+Renderer::Renderer(int width, int height) :
+	m_pBuffer(SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888)),
+	m_Width(width),
+	m_Height(height)
+{
+	//a size the surface can't be made for, or running out of memory, leaves the renderer invalid
+	if (!m_pBuffer)
+	{
+		std::cout << "Couldn't create a " << width << "x" << height << " buffer: " << SDL_GetError() << std::endl;
+		return;
+	}
+
+	InitializeBuffers();
+}
+
+Renderer::~Renderer()
+{
+	//the window owns its surface
+	if (!m_pWindow)
+	{
+		SDL_FreeSurface(m_pBuffer);
+	}
+}
+
+void Renderer::InitializeBuffers()
+{
 	m_pBufferPixels = static_cast<uint32_t*>(m_pBuffer->pixels);
 	m_AspectRatio = m_Width / static_cast<float>(m_Height);
+	m_AccumulationBuffer.resize(static_cast<size_t>(m_Width) * m_Height);
+	m_ConvergedPixels.resize(static_cast<size_t>(m_Width) * m_Height);
+	m_FrameColors.resize(static_cast<size_t>(m_Width) * m_Height);
+	m_DisplayColors.resize(static_cast<size_t>(m_Width) * m_Height);
+	m_RowEdgePixels.resize(static_cast<size_t>(m_Height));
+
+	//padded with directions that never get read, so the rotation doesn't need a scalar tail
+	const size_t paddedPixelCount{ (static_cast<size_t>(m_Width) * m_Height + 7) / 8 * 8 };
+
+	for (AlignedBuffer<float>* pComponent : { &m_CameraRayX, &m_CameraRayY, &m_CameraRayZ, &m_ViewRayX, &m_ViewRayY, &m_ViewRayZ })
+	{
+		pComponent->Allocate(paddedPixelCount);
+	}
+
+	m_SRGBTable.resize(SRGBTableSize);
+
+	for (uint32_t i{}; i < SRGBTableSize; ++i)
+	{
+		const float linear{ i / static_cast<float>(SRGBTableSize - 1) };
+		const float encoded{ linear <= 0.0031308f ? linear * 12.92f : 1.055f * powf(linear, 1.f / 2.4f) - 0.055f };
+
+		m_SRGBTable[i] = static_cast<uint32_t>(encoded * 255.f + 0.5f);
+	}
+
+	//one extra ray per pixel on average, so an eighth of the pixels can get the full m_AAMaxSamples of 9
+	m_AASampleBudget = static_cast<uint32_t>(m_Width * m_Height);
 }
 
-void Renderer::Render(Scene* pScene) const
+bool Renderer::Render(Scene* pScene)
 {
 	Camera& camera = pScene->GetCamera();
 	const auto& materials = pScene->GetMaterials();
@@ -39,163 +128,1043 @@ void Renderer::Render(Scene* pScene) const
 
 	camera.CalculateCameraToWorld();
 
-	const uint32_t numPixel{ static_cast<uint32_t>(m_Width * m_Height) };
-	
-#if defined(ASYNC)
-
-	const uint32_t numCores{ std::thread::hardware_concurrency() };
+	//the buffer only holds while the view stays the same
+	if (pScene->IsDirty() || !(camera.cameraToWorld == m_LastCameraToWorld) || camera.fovAngle != m_LastFovAngle)
+	{
+		m_AccumulatedFrames = 0;
+	}
 
-	std::vector<std::future<void>> async_futures{};
+	pScene->ClearDirty();
 
-	const uint32_t numPixelsPerTask{ numPixel / numCores };
-	uint32_t numAssignedPixels{ numPixel % numCores };
-	uint32_t currPixelIndex{0};
+	m_LastCameraToWorld = camera.cameraToWorld;
+	m_LastFovAngle = camera.fovAngle;
 
-	for (uint32_t coreid = 0; coreid < numCores; ++coreid)
+	if (m_AccumulatedFrames >= (m_ManyLightsEnabled ? m_MaxAccumulatedFrames : 1u))
 	{
-		uint32_t taskSize{ numPixelsPerTask };
+		if (!m_IsResolveDirty) return false;
 
-		if (numAssignedPixels > 0)
+		//only the tone mapping changed, the buffer still holds the whole image
+		ResolveFrame(false);
+
+		if (m_pWindow)
 		{
-			++taskSize;
-			--numAssignedPixels;
+			SDL_UpdateWindowSurface(m_pWindow);
 		}
 
-		async_futures.push_back(
-			std::async(std::launch::async, [=, this]
-				{
-					const uint32_t pixelIndexEnd{ currPixelIndex + taskSize };
+		return true;
+	}
 
-					for (uint32_t pixelIndex{ currPixelIndex }; pixelIndex < pixelIndexEnd; ++pixelIndex)
-					{
-						RenderPixel(pScene, pixelIndex, fov, m_AspectRatio, camera, lights, materials);
-					}
-				})
-		);
+	++m_AccumulatedFrames;
+	++m_FrameIndex;
 
-		currPixelIndex += taskSize;
-	}
+	//only scenes that moved something during Update get their top level BVH rebuilt
+	pScene->UpdateTopLevelBVH();
 
-	for (const std::future<void>& f : async_futures)
+	if (m_ManyLightsEnabled)
 	{
-		f.wait();
+		pScene->BuildLightBVH();
 	}
 
+	UpdateViewRays(fov, camera);
+
+	//the sampled lights of a hit are the directional lights plus m_LightSampleCount picks, never more than this
+	const size_t sampledLightCount{ lights.size() + m_LightSampleCount };
+
+#if defined(TILED)
+
+	m_TileScheduler.Run(m_Width, m_Height, m_TileWidth, m_TileHeight, [&, this](const Tile& tile)
+		{
+			//only the lights that can reach something inside the tile get shaded and traced
+			//the many light mode samples from all of them, so the tile gets the whole list
+			std::vector<Light> tileLights{};
+
+			if (m_ManyLightsEnabled) tileLights = lights;
+			else CullLights(tile, fov, camera, lights, tileLights);
+
+			ShadowRayCache shadowCache{ m_ManyLightsEnabled ? sampledLightCount : tileLights.size(), lights.size() };
+			std::vector<Light> sampledLights{};
+
+			if (m_PacketTracingEnabled)
+			{
+				RenderTilePackets(pScene, tile, camera, tileLights, materials, shadowCache, sampledLights);
+				return;
+			}
+
+			for (int py{ tile.minY }; py < tile.maxY; ++py)
+			{
+				for (int px{ tile.minX }; px < tile.maxX; ++px)
+				{
+					RenderPixel(pScene, static_cast<uint32_t>(py * m_Width + px), camera, tileLights, materials, shadowCache, sampledLights);
+				}
+			}
+		});
 
 #elif defined(PARAREL_FOR)
 
-	concurrency::parallel_for(0u, numPixel, [=, this](int i) {
-		RenderPixel(pScene, i, fov, m_AspectRatio, camera, lights, materials);
+	const uint32_t numPixel{ static_cast<uint32_t>(m_Width * m_Height) };
+
+	//a row of pixels at a time, on the same threads the tiles use
+	ThreadPool::GetShared().ParallelFor(numPixel, static_cast<size_t>(m_Width), [&, this](size_t firstPixel, size_t endPixel)
+		{
+			ShadowRayCache shadowCache{ sampledLightCount, lights.size() };
+			std::vector<Light> sampledLights{};
+
+			for (size_t pixelIndex{ firstPixel }; pixelIndex < endPixel; ++pixelIndex)
+			{
+				RenderPixel(pScene, static_cast<uint32_t>(pixelIndex), camera, lights, materials, shadowCache, sampledLights);
+			}
 		});
 
 #else
+	const uint32_t numPixel{ static_cast<uint32_t>(m_Width * m_Height) };
+
+	ShadowRayCache shadowCache{ sampledLightCount, lights.size() };
+	std::vector<Light> sampledLights{};
+
 	for (uint32_t i{}; i < numPixel; ++i)
 	{
-		RenderPixel(pScene, i, fov, m_AspectRatio, camera, lights, materials);
+		RenderPixel(pScene, i, camera, lights, materials, shadowCache, sampledLights);
 	}
 #endif
 
+	if (m_AdaptiveAAEnabled)
+	{
+		RefineEdges(pScene, fov, camera, lights, materials);
+	}
+
+	ResolveFrame(true);
+
 	//@END
 	//Update SDL Surface
-	SDL_UpdateWindowSurface(m_pWindow);
+	if (m_pWindow)
+	{
+		SDL_UpdateWindowSurface(m_pWindow);
+	}
+
+	return true;
 }
 
-void dae::Renderer::RenderPixel(Scene* scenePtr, uint32_t pixelIndex, float fov, float aspectRatio, const Camera& camera, const std::vector<Light>& lights, const std::vector<Material*>& materials) const
+void dae::Renderer::RenderPixel(Scene* scenePtr, uint32_t pixelIndex, const Camera& camera, const std::vector<Light>& lights, const MaterialTable& materials, ShadowRayCache& shadowCache, std::vector<Light>& sampledLights)
 {
 
-	const int px{ static_cast<int>(pixelIndex) % m_Width };
-	const int py{ static_cast<int>(pixelIndex) / m_Width };
-
-	const float halfPixel{ 0.5f };
-
-	float cx = (((2 * ( px + halfPixel)) / m_Width) - 1) * m_AspectRatio * fov;
-	float cy = (1 - ((2 * ( py + halfPixel)) / m_Height)) * fov;
+	if (m_AccumulatedFrames > 1 && m_ConvergedPixels[pixelIndex]) return;
 
-	Vector3 rayDirection{ camera.cameraToWorld.TransformVector({cx, cy, 1.f }).Normalized()};
+	const Ray viewRay{ GetViewRay(pixelIndex, camera) };
 
-	const Ray viewRay{ camera.origin, rayDirection };
+	bool isSampled{};
 
-	ColorRGB finalColor{};
+	m_FrameColors[pixelIndex] = TraceSample(scenePtr, viewRay, pixelIndex, lights, materials, shadowCache, sampledLights, isSampled);
+	m_ConvergedPixels[pixelIndex] = !isSampled;
+}
 
+//Shades what viewRay hits, seed picks the lights in the many light mode and isSampled tells whether it did
+ColorRGB dae::Renderer::TraceSample(const Scene* scenePtr, const Ray& viewRay, uint32_t seed, const std::vector<Light>& lights, const MaterialTable& materials, ShadowRayCache& shadowCache, std::vector<Light>& sampledLights, bool& isSampled) const
+{
 	HitRecord closestHit{};
 
 	scenePtr->GetClosestHit(viewRay, closestHit);
 
-	if (closestHit.didHit)
-	{
-		const float epsilon{ 0.001f };
+	isSampled = m_ManyLightsEnabled && closestHit.didHit;
 
-		closestHit.origin += (closestHit.normal * epsilon);
+	const std::vector<Light>& shadingLights{ isSampled ? SampleLights(scenePtr, closestHit.origin, seed, lights, sampledLights) : lights };
 
-		for (const Light& light : lights)
+	TraceShadowRays(scenePtr, &closestHit, 1, shadingLights, shadowCache);
+
+	return ShadeHit(viewRay, closestHit, shadingLights, materials, shadowCache.visibleLanes, 0);
+}
+
+//Traces the tile in 2x2 blocks and shades their hits grouped by material kind once all of them are traced
+//blocks that stick out of the tile are rendered per pixel
+void dae::Renderer::RenderTilePackets(Scene* scenePtr, const Tile& tile, const Camera& camera, const std::vector<Light>& lights, const MaterialTable& materials, ShadowRayCache& shadowCache, std::vector<Light>& sampledLights)
+{
+	ShadingBatch batch{};
+
+	for (int py{ tile.minY }; py < tile.maxY; py += 2)
+	{
+		for (int px{ tile.minX }; px < tile.maxX; px += 2)
 		{
+			if (px + 1 >= tile.maxX || py + 1 >= tile.maxY)
+			{
+				for (int y{ py }; y < std::min(py + 2, tile.maxY); ++y)
+				{
+					for (int x{ px }; x < std::min(px + 2, tile.maxX); ++x)
+					{
+						RenderPixel(scenePtr, static_cast<uint32_t>(y * m_Width + x), camera, lights, materials, shadowCache, sampledLights);
+					}
+				}
 
-			Vector3 lightDirection = LightUtils::GetDirectionToLight(light, closestHit.origin);
+				continue;
+			}
 
-			const float magnitude{ lightDirection.Normalize() };
+			const uint32_t blockIndex{ static_cast<uint32_t>(py * m_Width + px) };
 
-			if (m_ShadowsEnabled)
+			if (m_AccumulatedFrames > 1 &&
+				m_ConvergedPixels[blockIndex] && m_ConvergedPixels[blockIndex + 1] &&
+				m_ConvergedPixels[blockIndex + m_Width] && m_ConvergedPixels[blockIndex + m_Width + 1])
 			{
-				const Ray shadowRay{ closestHit.origin, lightDirection, epsilon, magnitude };
+				continue;
+			}
+
+			RayPacket packet{};
+			HitRecord closestHits[RayPacket::Size]{};
 
-				if (scenePtr->DoesHit(shadowRay))
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				packet.rays[lane] = GetViewRay(blockIndex + (lane >> 1) * m_Width + (lane & 1), camera);
+			}
+
+			scenePtr->GetClosestHitPacket(packet, closestHits);
+
+			//the whole block shares the picks of its first hit, the pick probabilities don't depend on the lane, so it stays unbiased
+			const std::vector<Light>* pShadingLights{ &lights };
+
+			if (m_ManyLightsEnabled)
+			{
+				for (int lane{}; lane < RayPacket::Size; ++lane)
 				{
+					if (!closestHits[lane].didHit) continue;
+
+					pShadingLights = &SampleLights(scenePtr, closestHits[lane].origin, blockIndex, lights, sampledLights);
+					break;
+				}
+			}
+
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				m_ConvergedPixels[blockIndex + (lane >> 1) * m_Width + (lane & 1)] = pShadingLights == &lights;
+			}
+
+			TraceShadowRays(scenePtr, closestHits, RayPacket::Size, *pShadingLights, shadowCache);
+
+			//the next block overwrites the picks and the visibility, the batch keeps its own copy
+			ShadingBatch::Block block{};
+			block.isSampled = pShadingLights != &lights;
+			block.firstLight = batch.sampledLights.size();
+			block.lightCount = pShadingLights->size();
+			block.firstVisibility = batch.visibleLanes.size();
+
+			if (block.isSampled)
+			{
+				batch.sampledLights.insert(batch.sampledLights.end(), pShadingLights->begin(), pShadingLights->end());
+			}
+
+			batch.visibleLanes.insert(batch.visibleLanes.end(), shadowCache.visibleLanes.begin(), shadowCache.visibleLanes.begin() + block.lightCount);
+
+			const uint32_t blockIdx{ static_cast<uint32_t>(batch.blocks.size()) };
+			batch.blocks.push_back(block);
+
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				const uint32_t pixelIndex{ blockIndex + (lane >> 1) * m_Width + (lane & 1) };
+
+				if (!closestHits[lane].didHit)
+				{
+					m_FrameColors[pixelIndex] = {};
 					continue;
 				}
+
+				const size_t kindIdx{ static_cast<size_t>(materials.kinds[closestHits[lane].materialIndex]) };
+
+				batch.buckets[kindIdx].push_back({ closestHits[lane], packet.rays[lane].direction, pixelIndex, blockIdx, lane });
+			}
+		}
+	}
+
+	ShadeBatch(batch, lights, materials);
+}
+
+//Through the center of the pixel, UpdateViewRays has to have run for this frame
+Ray dae::Renderer::GetViewRay(uint32_t pixelIndex, const Camera& camera) const
+{
+	return Ray{ camera.origin, { m_ViewRayX[pixelIndex], m_ViewRayY[pixelIndex], m_ViewRayZ[pixelIndex] } };
+}
+
+//Rebuilds the camera space directions when the fov changed and rotates all of them into world space, as wide as the CPU allows
+//the camera matrix only rotates, so directions that are normalized in camera space stay normalized
+void dae::Renderer::UpdateViewRays(float fov, const Camera& camera)
+{
+	if (fov != m_ViewRayFov)
+	{
+		const float halfPixel{ 0.5f };
+
+		for (int py{}; py < m_Height; ++py)
+		{
+			for (int px{}; px < m_Width; ++px)
+			{
+				const size_t pixelIndex{ static_cast<size_t>(py) * m_Width + px };
+
+				const float cx{ (((2 * (px + halfPixel)) / m_Width) - 1) * m_AspectRatio * fov };
+				const float cy{ (1 - ((2 * (py + halfPixel)) / m_Height)) * fov };
+
+				const Vector3 direction{ Vector3{ cx, cy, 1.f }.Normalized() };
+
+				m_CameraRayX[pixelIndex] = direction.x;
+				m_CameraRayY[pixelIndex] = direction.y;
+				m_CameraRayZ[pixelIndex] = direction.z;
 			}
+		}
 
-			const float observedArea{ Vector3::Dot(closestHit.normal, lightDirection) };
+		//the padding never gets read, it just shouldn't hold garbage that gets rotated along
+		for (size_t pixelIndex{ static_cast<size_t>(m_Width) * m_Height }; pixelIndex < m_CameraRayX.Size(); ++pixelIndex)
+		{
+			m_CameraRayX[pixelIndex] = 0.f;
+			m_CameraRayY[pixelIndex] = 0.f;
+			m_CameraRayZ[pixelIndex] = 1.f;
+		}
+
+		m_ViewRayFov = fov;
+	}
 
-			if (observedArea < epsilon) continue;
+	const Matrix& cameraToWorld{ camera.cameraToWorld };
+	const Utils::SIMDLevel simdLevel{ Utils::GetSIMDLevel() };
 
-			switch (m_CurrentLightingMode)
+	const auto rotateRange = [&](size_t firstPixel, size_t endPixel)
+		{
+			if (simdLevel == Utils::SIMDLevel::AVX2)
+			{
+				RotateViewRays8(firstPixel, endPixel, cameraToWorld);
+			}
+			else if (simdLevel == Utils::SIMDLevel::SSE)
+			{
+				RotateViewRays4(firstPixel, endPixel, cameraToWorld);
+			}
+			else
 			{
-				case dae::Renderer::LightingMode::ObservedArea:
+				for (size_t pixelIndex{ firstPixel }; pixelIndex < endPixel; ++pixelIndex)
 				{
+					const Vector3 direction{ cameraToWorld.TransformVector(m_CameraRayX[pixelIndex], m_CameraRayY[pixelIndex], m_CameraRayZ[pixelIndex]) };
+
+					m_ViewRayX[pixelIndex] = direction.x;
+					m_ViewRayY[pixelIndex] = direction.y;
+					m_ViewRayZ[pixelIndex] = direction.z;
+				}
+			}
+		};
+
+	//the tables are padded to a multiple of 8, so every chunk rotates whole registers
+#if defined(TILED) || defined(PARAREL_FOR)
+	ThreadPool::GetShared().ParallelFor(m_CameraRayX.Size(), 8192, rotateRange);
+#else
+	rotateRange(0, m_CameraRayX.Size());
+#endif
+}
+
+void dae::Renderer::RotateViewRays4(size_t firstPixel, size_t endPixel, const Matrix& cameraToWorld)
+{
+	__m128 axes[3][3]{};
+
+	for (int axis{}; axis < 3; ++axis)
+	{
+		axes[axis][0] = _mm_set1_ps(cameraToWorld[axis].x);
+		axes[axis][1] = _mm_set1_ps(cameraToWorld[axis].y);
+		axes[axis][2] = _mm_set1_ps(cameraToWorld[axis].z);
+	}
+
+	for (size_t pixelIndex{ firstPixel }; pixelIndex < endPixel; pixelIndex += 4)
+	{
+		const __m128 x{ _mm_load_ps(m_CameraRayX.Data() + pixelIndex) };
+		const __m128 y{ _mm_load_ps(m_CameraRayY.Data() + pixelIndex) };
+		const __m128 z{ _mm_load_ps(m_CameraRayZ.Data() + pixelIndex) };
 
-					finalColor += ColorRGB{ 1.f,1.f,1.f } * observedArea;
+		float* pViewRays[3]{ m_ViewRayX.Data() + pixelIndex, m_ViewRayY.Data() + pixelIndex, m_ViewRayZ.Data() + pixelIndex };
 
+		for (int component{}; component < 3; ++component)
+		{
+			const __m128 rotated{ _mm_add_ps(_mm_add_ps(_mm_mul_ps(axes[0][component], x), _mm_mul_ps(axes[1][component], y)), _mm_mul_ps(axes[2][component], z)) };
+
+			_mm_store_ps(pViewRays[component], rotated);
+		}
+	}
+}
+
+//Only called once GetSIMDLevel() reported AVX2
+DAE_TARGET_AVX2 void dae::Renderer::RotateViewRays8(size_t firstPixel, size_t endPixel, const Matrix& cameraToWorld)
+{
+	__m256 axes[3][3]{};
+
+	for (int axis{}; axis < 3; ++axis)
+	{
+		axes[axis][0] = _mm256_set1_ps(cameraToWorld[axis].x);
+		axes[axis][1] = _mm256_set1_ps(cameraToWorld[axis].y);
+		axes[axis][2] = _mm256_set1_ps(cameraToWorld[axis].z);
+	}
+
+	for (size_t pixelIndex{ firstPixel }; pixelIndex < endPixel; pixelIndex += 8)
+	{
+		const __m256 x{ _mm256_load_ps(m_CameraRayX.Data() + pixelIndex) };
+		const __m256 y{ _mm256_load_ps(m_CameraRayY.Data() + pixelIndex) };
+		const __m256 z{ _mm256_load_ps(m_CameraRayZ.Data() + pixelIndex) };
+
+		float* pViewRays[3]{ m_ViewRayX.Data() + pixelIndex, m_ViewRayY.Data() + pixelIndex, m_ViewRayZ.Data() + pixelIndex };
+
+		for (int component{}; component < 3; ++component)
+		{
+			const __m256 rotated{ _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(axes[0][component], x), _mm256_mul_ps(axes[1][component], y)), _mm256_mul_ps(axes[2][component], z)) };
+
+			_mm256_store_ps(pViewRays[component], rotated);
+		}
+	}
+}
+
+//x and y are in pixels, whole numbers are the corners of the pixels
+Vector3 dae::Renderer::GetViewDirection(float x, float y, float fov, const Camera& camera) const
+{
+	float cx = (((2 * x) / m_Width) - 1) * m_AspectRatio * fov;
+	float cy = (1 - ((2 * y) / m_Height)) * fov;
+
+	return camera.cameraToWorld.TransformVector({ cx, cy, 1.f }).Normalized();
+}
+
+//Tiled light culling, keeps the lights whose influence sphere reaches into the frustum of the tile
+//the frustum has no far plane, so this only pays off for lights with a finite influenceRadius
+void dae::Renderer::CullLights(const Tile& tile, float fov, const Camera& camera, const std::vector<Light>& lights, std::vector<Light>& tileLights) const
+{
+	tileLights.clear();
+
+	const Vector3 topLeft{ GetViewDirection(static_cast<float>(tile.minX), static_cast<float>(tile.minY), fov, camera) };
+	const Vector3 topRight{ GetViewDirection(static_cast<float>(tile.maxX), static_cast<float>(tile.minY), fov, camera) };
+	const Vector3 bottomLeft{ GetViewDirection(static_cast<float>(tile.minX), static_cast<float>(tile.maxY), fov, camera) };
+	const Vector3 bottomRight{ GetViewDirection(static_cast<float>(tile.maxX), static_cast<float>(tile.maxY), fov, camera) };
+
+	const Vector3 center{ topLeft + topRight + bottomLeft + bottomRight };
+
+	//side planes of the frustum, they all go through the camera
+	Vector3 planeNormals[4]{
+		Vector3::Cross(topLeft, bottomLeft),
+		Vector3::Cross(bottomLeft, bottomRight),
+		Vector3::Cross(bottomRight, topRight),
+		Vector3::Cross(topRight, topLeft) };
+
+	for (Vector3& planeNormal : planeNormals)
+	{
+		planeNormal.Normalize();
+
+		//point them into the frustum, whatever the handedness of the camera
+		if (Vector3::Dot(planeNormal, center) < 0.f) planeNormal = -planeNormal;
+	}
+
+	for (const Light& light : lights)
+	{
+		bool isInside{ true };
+
+		if (light.influenceRadius != FLT_MAX)
+		{
+			const Vector3 cameraToLight{ light.origin - camera.origin };
+
+			for (const Vector3& planeNormal : planeNormals)
+			{
+				if (Vector3::Dot(planeNormal, cameraToLight) < -light.influenceRadius)
+				{
+					isInside = false;
+					break;
 				}
+			}
+		}
+
+		if (isInside)
+		{
+			tileLights.push_back(light);
+		}
+	}
+}
+
+//Gathers the shadow rays of all lights for up to RayPacket::Size hits and traces them 4 at a time
+//rays are ordered by light, so a packet holds the rays of neighbouring hits towards the same light, or with a single hit the rays towards 4 lights
+//bit lane of visibleLanes[lightIdx] ends up set when that light reaches the hit of that lane, hit origins get moved off their surface
+void dae::Renderer::TraceShadowRays(const Scene* scenePtr, HitRecord hits[], int hitCount, const std::vector<Light>& lights, ShadowRayCache& shadowCache) const
+{
+	std::vector<uint8_t>& visibleLanes{ shadowCache.visibleLanes };
+
+	const float epsilon{ 0.001f };
+
+	for (int lane{}; lane < hitCount; ++lane)
+	{
+		if (hits[lane].didHit)
+		{
+			hits[lane].origin += (hits[lane].normal * epsilon);
+		}
+	}
+
+	std::fill(visibleLanes.begin(), visibleLanes.end(), uint8_t{});
+
+	RayPacket packet{};
+	size_t packetLights[RayPacket::Size]{};
+	int packetLanes[RayPacket::Size]{};
+	uint32_t occluderHints[RayPacket::Size]{};
+	int packetSize{};
+
+	const auto tracePacket = [&]()
+		{
+			for (int i{}; i < packetSize; ++i)
+			{
+				occluderHints[i] = shadowCache.lastOccluders[lights[packetLights[i]].sceneIndex];
+			}
+
+			const int occludedMask{ scenePtr->OccludedPacket(packet, (1 << packetSize) - 1, occluderHints) };
+
+			for (int i{}; i < packetSize; ++i)
+			{
+				if (occludedMask & (1 << i))
+				{
+					shadowCache.lastOccluders[lights[packetLights[i]].sceneIndex] = occluderHints[i];
+					continue;
+				}
+
+				visibleLanes[packetLights[i]] |= static_cast<uint8_t>(1 << packetLanes[i]);
+			}
+
+			packetSize = 0;
+		};
+
+	for (size_t lightIdx{}; lightIdx < lights.size(); ++lightIdx)
+	{
+		for (int lane{}; lane < hitCount; ++lane)
+		{
+			const HitRecord& hit{ hits[lane] };
+
+			if (!hit.didHit) continue;
+
+			Vector3 lightDirection{ LightUtils::GetDirectionToLight(lights[lightIdx], hit.origin) };
+
+			const float magnitude{ lightDirection.Normalize() };
+
+			//lights behind the surface or out of reach don't get shaded, there is no point in tracing them
+			if (Vector3::Dot(hit.normal, lightDirection) < epsilon || magnitude > lights[lightIdx].influenceRadius) continue;
+
+			if (!m_ShadowsEnabled)
+			{
+				visibleLanes[lightIdx] |= static_cast<uint8_t>(1 << lane);
+				continue;
+			}
+
+			packet.rays[packetSize] = Ray{ hit.origin, lightDirection, epsilon, magnitude };
+			packetLights[packetSize] = lightIdx;
+			packetLanes[packetSize] = lane;
+
+			if (++packetSize == RayPacket::Size)
+			{
+				tracePacket();
+			}
+		}
+	}
+
+	if (packetSize > 0)
+	{
+		tracePacket();
+	}
+}
+
+//Many light mode, keeps the directional lights and replaces the point lights by m_LightSampleCount picks from the light BVH around position
+//every pick gets its intensity divided by the pick count and its probability, so on average it shades like all of them together
+const std::vector<Light>& dae::Renderer::SampleLights(const Scene* scenePtr, const Vector3& position, uint32_t seed, const std::vector<Light>& lights, std::vector<Light>& sampledLights) const
+{
+	sampledLights.clear();
+
+	for (const Light& light : lights)
+	{
+		if (light.type == LightType::Directional) sampledLights.push_back(light);
+	}
+
+	uint32_t randomState{ Utils::HashPCG(seed ^ Utils::HashPCG(m_FrameIndex)) };
+
+	for (uint32_t i{}; i < m_LightSampleCount; ++i)
+	{
+		float pdf{};
+		const int lightIdx{ scenePtr->SampleLight(position, Utils::RandomFloat(randomState), pdf) };
+
+		if (lightIdx < 0) break;
+
+		Light sampledLight{ lights[lightIdx] };
+		sampledLight.intensity /= pdf * m_LightSampleCount;
+
+		sampledLights.push_back(sampledLight);
+	}
+
+	return sampledLights;
+}
+
+//Per pixel path for the edge blocks and the untiled modes, the kind of material only gets looked at once per hit, the light loop then calls its Shade directly
+ColorRGB dae::Renderer::ShadeHit(const Ray& viewRay, const HitRecord& closestHit, const std::vector<Light>& lights, const MaterialTable& materials, const std::vector<uint8_t>& visibleLanes, int lane) const
+{
+	if (!closestHit.didHit) return {};
+
+	const uint32_t parameterIdx{ materials.parameterIndices[closestHit.materialIndex] };
+
+	switch (materials.kinds[closestHit.materialIndex])
+	{
+	case MaterialKind::SolidColor:
+		return ShadeLights<Material_SolidColor>(viewRay.direction, closestHit, lights, materials.solidColors[parameterIdx], visibleLanes, lane);
+	case MaterialKind::Lambert:
+		return ShadeLights<Material_Lambert>(viewRay.direction, closestHit, lights, materials.lamberts[parameterIdx], visibleLanes, lane);
+	case MaterialKind::LambertPhong:
+		return ShadeLights<Material_LambertPhong>(viewRay.direction, closestHit, lights, materials.lambertPhongs[parameterIdx], visibleLanes, lane);
+	case MaterialKind::CookTorrence:
+		return ShadeLights<Material_CookTorrence>(viewRay.direction, closestHit, lights, materials.cookTorrences[parameterIdx], visibleLanes, lane);
+	}
+
+	return {};
+}
+
+template<typename MaterialType>
+ColorRGB dae::Renderer::ShadeLights(const Vector3& viewDirection, const HitRecord& closestHit, std::span<const Light> lights, const typename MaterialType::Parameters& parameters, std::span<const uint8_t> visibleLanes, int lane) const
+{
+	ColorRGB finalColor{};
+
+	const float epsilon{ 0.001f };
+
+	for (size_t lightIdx{}; lightIdx < lights.size(); ++lightIdx)
+	{
+		if (!(visibleLanes[lightIdx] & (1 << lane))) continue;
+
+		const Light& light{ lights[lightIdx] };
+
+		Vector3 lightDirection = LightUtils::GetDirectionToLight(light, closestHit.origin);
+
+		lightDirection.Normalize();
+
+		const float observedArea{ Vector3::Dot(closestHit.normal, lightDirection) };
+
+		if (observedArea < epsilon) continue;
+
+		switch (m_CurrentLightingMode)
+		{
+			case dae::Renderer::LightingMode::ObservedArea:
+			{
+
+				finalColor += ColorRGB{ 1.f,1.f,1.f } * observedArea;
+
+			}
+
+			break;
+			case dae::Renderer::LightingMode::Radiance:
+			{
+				finalColor += LightUtils::GetRadiance(light, closestHit.origin);
+
+				break;
+			}
+			case dae::Renderer::LightingMode::BRDF:
+
+				finalColor += MaterialType::Shade(parameters, closestHit, lightDirection, -viewDirection);
+
+				break;
+			case dae::Renderer::LightingMode::Combined:
+			{
+				ColorRGB areaColor{ ColorRGB{ 1.f,1.f,1.f } * observedArea };
+
+				finalColor += LightUtils::GetRadiance(light, closestHit.origin) * areaColor * MaterialType::Shade(parameters, closestHit, lightDirection, -viewDirection);
 
 				break;
-				case dae::Renderer::LightingMode::Radiance:
+			}
+
+				default:
+				break;
+		}
+
+	}
+
+	return finalColor;
+}
+
+//Every kind of material gets looked at once per batch, its hits then all go through the same kernel
+void dae::Renderer::ShadeBatch(const ShadingBatch& batch, const std::vector<Light>& lights, const MaterialTable& materials)
+{
+	ShadeBucket<Material_SolidColor>(batch, MaterialKind::SolidColor, lights, materials.parameterIndices, materials.solidColors);
+	ShadeBucket<Material_Lambert>(batch, MaterialKind::Lambert, lights, materials.parameterIndices, materials.lamberts);
+	ShadeBucket<Material_LambertPhong>(batch, MaterialKind::LambertPhong, lights, materials.parameterIndices, materials.lambertPhongs);
+	ShadeBucket<Material_CookTorrence>(batch, MaterialKind::CookTorrence, lights, materials.parameterIndices, materials.cookTorrences);
+}
+
+template<typename MaterialType>
+void dae::Renderer::ShadeBucket(const ShadingBatch& batch, MaterialKind kind, const std::vector<Light>& lights, const std::vector<uint32_t>& parameterIndices, const std::vector<typename MaterialType::Parameters>& parameterArray)
+{
+	const std::span<const Light> sampledLights{ batch.sampledLights };
+	const std::span<const uint8_t> visibleLanes{ batch.visibleLanes };
+
+	for (const ShadingBatch::Hit& hit : batch.buckets[static_cast<size_t>(kind)])
+	{
+		const ShadingBatch::Block& block{ batch.blocks[hit.blockIdx] };
+
+		const std::span<const Light> blockLights{ block.isSampled ? sampledLights.subspan(block.firstLight, block.lightCount) : std::span<const Light>{ lights } };
+
+		m_FrameColors[hit.pixelIndex] = ShadeLights<MaterialType>(hit.viewDirection, hit.record, blockLights,
+			parameterArray[parameterIndices[hit.record.materialIndex]], visibleLanes.subspan(block.firstVisibility, block.lightCount), hit.lane);
+	}
+}
+
+//Picks the pixels that differ too much from a neighbour and supersamples them, spread over the worker threads
+void dae::Renderer::RefineEdges(Scene* scenePtr, float fov, const Camera& camera, const std::vector<Light>& lights, const MaterialTable& materials)
+{
+	//contrast is judged on what ends up on screen, so on the tone mapped colors
+	const auto toneMapRows = [this](size_t firstRow, size_t endRow)
+		{
+			for (size_t pixelIndex{ firstRow * m_Width }; pixelIndex < endRow * m_Width; ++pixelIndex)
+			{
+				m_DisplayColors[pixelIndex] = ToneMap(m_FrameColors[pixelIndex]);
+			}
+		};
+
+	//per channel, so edges between colors of the same brightness count as well
+	const auto getContrast = [](const ColorRGB& a, const ColorRGB& b)
+		{
+			return std::max(std::abs(a.r - b.r), std::max(std::abs(a.g - b.g), std::abs(a.b - b.b)));
+		};
+
+	//every row collects its own edge pixels, so the rows can be searched on different threads
+	const auto findEdgeRows = [&, this](size_t firstRow, size_t endRow)
+		{
+			for (int py{ static_cast<int>(firstRow) }; py < static_cast<int>(endRow); ++py)
+			{
+				std::vector<EdgePixel>& rowEdgePixels{ m_RowEdgePixels[py] };
+				rowEdgePixels.clear();
+
+				for (int px{}; px < m_Width; ++px)
 				{
-					finalColor += LightUtils::GetRadiance(light, closestHit.origin);
+					const uint32_t pixelIndex{ static_cast<uint32_t>(py * m_Width + px) };
 
-					break;
+					if (m_AccumulatedFrames > 1 && m_ConvergedPixels[pixelIndex]) continue;
+
+					const ColorRGB& displayColor{ m_DisplayColors[pixelIndex] };
+					float contrast{};
+
+					if (px > 0) contrast = std::max(contrast, getContrast(displayColor, m_DisplayColors[pixelIndex - 1]));
+					if (px + 1 < m_Width) contrast = std::max(contrast, getContrast(displayColor, m_DisplayColors[pixelIndex + 1]));
+					if (py > 0) contrast = std::max(contrast, getContrast(displayColor, m_DisplayColors[pixelIndex - m_Width]));
+					if (py + 1 < m_Height) contrast = std::max(contrast, getContrast(displayColor, m_DisplayColors[pixelIndex + m_Width]));
+
+					if (contrast > m_AAContrastThreshold)
+					{
+						rowEdgePixels.push_back({ pixelIndex, contrast });
+					}
 				}
-				case dae::Renderer::LightingMode::BRDF:
+			}
+		};
 
-					finalColor += materials[closestHit.materialIndex]->Shade(closestHit, lightDirection, -viewRay.direction);
+	//the contrast of a row reads its neighbouring rows, so all of them have to be tone mapped first
+#if defined(TILED) || defined(PARAREL_FOR)
+	const size_t rowsPerChunk{ 8 };
 
-					break;
-				case dae::Renderer::LightingMode::Combined:
+	ThreadPool::GetShared().ParallelFor(static_cast<size_t>(m_Height), rowsPerChunk, toneMapRows);
+	ThreadPool::GetShared().ParallelFor(static_cast<size_t>(m_Height), rowsPerChunk, findEdgeRows);
+#else
+	toneMapRows(0, static_cast<size_t>(m_Height));
+	findEdgeRows(0, static_cast<size_t>(m_Height));
+#endif
+
+	//in row order, so the list stays in scanline order
+	m_EdgePixels.clear();
+
+	for (const std::vector<EdgePixel>& rowEdgePixels : m_RowEdgePixels)
+	{
+		m_EdgePixels.insert(m_EdgePixels.end(), rowEdgePixels.begin(), rowEdgePixels.end());
+	}
+
+	//every pixel might take all of its extra samples, keep the ones with the highest contrast that fit in the budget
+	const size_t maxEdgePixels{ m_AASampleBudget / std::max(m_AAMaxSamples - 1, 1u) };
+
+	if (m_EdgePixels.size() > maxEdgePixels)
+	{
+		std::nth_element(m_EdgePixels.begin(), m_EdgePixels.begin() + maxEdgePixels, m_EdgePixels.end(),
+			[](const EdgePixel& a, const EdgePixel& b) { return a.contrast > b.contrast; });
+
+		m_EdgePixels.resize(maxEdgePixels);
+
+		//back in scanline order, so neighbouring pixels end up on the same thread
+		std::sort(m_EdgePixels.begin(), m_EdgePixels.end(),
+			[](const EdgePixel& a, const EdgePixel& b) { return a.pixelIndex < b.pixelIndex; });
+	}
+
+	const size_t sampledLightCount{ lights.size() + m_LightSampleCount };
+
+#if defined(TILED) || defined(PARAREL_FOR)
+
+	//runs of neighbouring edge pixels per chunk
+	const size_t edgePixelsPerChunk{ 64 };
+
+	ThreadPool::GetShared().ParallelFor(m_EdgePixels.size(), edgePixelsPerChunk, [&, this](size_t firstEdgePixel, size_t endEdgePixel)
+		{
+			ShadowRayCache shadowCache{ sampledLightCount, lights.size() };
+			std::vector<Light> sampledLights{};
+
+			for (size_t i{ firstEdgePixel }; i < endEdgePixel; ++i)
+			{
+				RefinePixel(scenePtr, m_EdgePixels[i].pixelIndex, fov, camera, lights, materials, shadowCache, sampledLights);
+			}
+		});
+
+#else
+	ShadowRayCache shadowCache{ sampledLightCount, lights.size() };
+	std::vector<Light> sampledLights{};
+
+	for (const EdgePixel& edgePixel : m_EdgePixels)
+	{
+		RefinePixel(scenePtr, edgePixel.pixelIndex, fov, camera, lights, materials, shadowCache, sampledLights);
+	}
+#endif
+}
+
+//Adds samples to a pixel, its center sample of this frame counts as the first one
+void dae::Renderer::RefinePixel(Scene* scenePtr, uint32_t pixelIndex, float fov, const Camera& camera, const std::vector<Light>& lights, const MaterialTable& materials, ShadowRayCache& shadowCache, std::vector<Light>& sampledLights)
+{
+	//the standard 8x MSAA pattern in 1/16th of a pixel, the first 4 lie in different quadrants
+	//so the early out can't stop on samples that all ended up on the same side of an edge
+	static constexpr int MaxSampleOffsets{ 8 };
+	static constexpr float sampleOffsets[MaxSampleOffsets][2]{
+		{ 1.f, -3.f }, { -1.f, 3.f }, { 5.f, 1.f }, { -3.f, -5.f },
+		{ -5.f, 5.f }, { -7.f, -1.f }, { 3.f, 7.f }, { 7.f, -7.f } };
+
+	const int px{ static_cast<int>(pixelIndex) % m_Width };
+	const int py{ static_cast<int>(pixelIndex) / m_Width };
+
+	const uint32_t pixelCount{ static_cast<uint32_t>(m_Width * m_Height) };
+
+	ColorRGB colorSum{ m_FrameColors[pixelIndex] };
+
+	//the error estimate works on the tone mapped colors, like the contrast that got the pixel here
+	ColorRGB displaySum{ m_DisplayColors[pixelIndex] };
+	ColorRGB displaySquaredSum{ displaySum.r * displaySum.r, displaySum.g * displaySum.g, displaySum.b * displaySum.b };
+
+	uint32_t sampleCount{ 1 };
+	bool isAnySampled{};
+
+	const uint32_t maxSamples{ std::min(m_AAMaxSamples, MaxSampleOffsets + 1u) };
+
+	while (sampleCount < maxSamples)
+	{
+		//past the first few samples, stop once the standard error of the mean is small enough
+		if (sampleCount >= m_AAMinSamples)
+		{
+			const float invSampleCount{ 1.f / sampleCount };
+
+			const auto getVariance = [invSampleCount](float sum, float squaredSum)
 				{
-					ColorRGB areaColor{ ColorRGB{ 1.f,1.f,1.f } * observedArea };
+					const float mean{ sum * invSampleCount };
+					return std::max(squaredSum * invSampleCount - mean * mean, 0.f);
+				};
 
-					finalColor += LightUtils::GetRadiance(light, closestHit.origin) * areaColor * materials[closestHit.materialIndex]->Shade(closestHit, lightDirection, -viewRay.direction);
+			const float variance{ std::max(getVariance(displaySum.r, displaySquaredSum.r),
+				std::max(getVariance(displaySum.g, displaySquaredSum.g), getVariance(displaySum.b, displaySquaredSum.b))) };
 
-					break;
-				}
+			if (variance * invSampleCount < m_AAErrorThreshold * m_AAErrorThreshold) break;
+		}
 
-					default:
-					break;
+		const float x{ px + 0.5f + sampleOffsets[sampleCount - 1][0] / 16.f };
+		const float y{ py + 0.5f + sampleOffsets[sampleCount - 1][1] / 16.f };
+
+		const Ray viewRay{ camera.origin, GetViewDirection(x, y, fov, camera) };
+
+		bool isSampled{};
+
+		//every sample gets its own light picks in the many light mode
+		ColorRGB color{ TraceSample(scenePtr, viewRay, pixelIndex + sampleCount * pixelCount, lights, materials, shadowCache, sampledLights, isSampled) };
+
+		isAnySampled |= isSampled;
+		colorSum += color;
+
+		color = ToneMap(color);
+
+		displaySum += color;
+		displaySquaredSum += ColorRGB{ color.r * color.r, color.g * color.g, color.b * color.b };
+
+		++sampleCount;
+	}
+
+	m_FrameColors[pixelIndex] = colorSum * (1.f / sampleCount);
+
+	if (isAnySampled) m_ConvergedPixels[pixelIndex] = false;
+}
+
+//Blends the colors of this frame into the accumulation buffer and writes the buffer to the window
+//hasNewFrame is false when only the tone mapping changed and the buffer just needs to be shown again
+void dae::Renderer::ResolveFrame(bool hasNewFrame)
+{
+	const SDL_PixelFormat* pFormat{ m_pBuffer->format };
+
+	//8 bit channels in a 32 bit pixel can be packed with shifts, any other format goes through SDL_MapRGB
+	const bool canPack{ pFormat->BytesPerPixel == 4 && pFormat->Rloss == 0 && pFormat->Gloss == 0 && pFormat->Bloss == 0 };
+
+	const auto resolveRange = [=, this](size_t firstPixel, size_t endPixel)
+		{
+			if (hasNewFrame) AccumulatePixels(firstPixel, endPixel);
+
+			ResolvePixels(firstPixel, endPixel, canPack);
+		};
+
+#if defined(TILED) || defined(PARAREL_FOR)
+	//chunks of a multiple of 8 pixels, so only the last one can have pixels left that don't fill a register
+	ThreadPool::GetShared().ParallelFor(m_AccumulationBuffer.size(), 8192, resolveRange);
+#else
+	resolveRange(0, m_AccumulationBuffer.size());
+#endif
+
+	m_IsResolveDirty = false;
+}
+
+void dae::Renderer::AccumulatePixels(size_t firstPixel, size_t endPixel)
+{
+	for (size_t pixelIndex{ firstPixel }; pixelIndex < endPixel; ++pixelIndex)
+	{
+		//converged pixels weren't rendered again, their average already is their color
+		if (m_AccumulatedFrames > 1 && m_ConvergedPixels[pixelIndex]) continue;
+
+		ColorRGB& averageColor{ m_AccumulationBuffer[pixelIndex] };
+
+		if (m_AccumulatedFrames == 1)
+		{
+			averageColor = m_FrameColors[pixelIndex];
+			continue;
+		}
+
+		//running average of the frames since the view last changed, only the many light mode gets here
+		const float weight{ 1.f / m_AccumulatedFrames };
+
+		averageColor *= 1.f - weight;
+		averageColor += m_FrameColors[pixelIndex] * weight;
+	}
+}
+
+//Tone maps, encodes and packs the pixels, 8 at a time when the CPU has AVX2, the pixels that are left go through the same steps one by one
+void dae::Renderer::ResolvePixels(size_t firstPixel, size_t endPixel, bool canPack) const
+{
+	const SDL_PixelFormat* pFormat{ m_pBuffer->format };
+
+	const float quantizeScale{ m_SRGBEnabled ? SRGBTableSize - 1.f : 255.f };
+	const float quantizeBias{ m_SRGBEnabled ? 0.5f : 0.f };
+
+	size_t pixelIndex{ firstPixel };
+
+	if (canPack && Utils::GetSIMDLevel() == Utils::SIMDLevel::AVX2)
+	{
+		pixelIndex = ResolvePixels8(firstPixel, endPixel);
+	}
+
+	for (; pixelIndex < endPixel; ++pixelIndex)
+	{
+		const ColorRGB color{ ToneMap(m_AccumulationBuffer[pixelIndex]) };
+		const float channels[3]{ color.r, color.g, color.b };
+
+		uint32_t values[3]{};
+
+		for (int channelIdx{}; channelIdx < 3; ++channelIdx)
+		{
+			const uint32_t value{ static_cast<uint32_t>(std::clamp(channels[channelIdx], 0.f, 1.f) * quantizeScale + quantizeBias) };
+
+			values[channelIdx] = m_SRGBEnabled ? m_SRGBTable[value] : value;
+		}
+
+		if (canPack)
+		{
+			m_pBufferPixels[pixelIndex] = pFormat->Amask | values[0] << pFormat->Rshift | values[1] << pFormat->Gshift | values[2] << pFormat->Bshift;
+		}
+		else
+		{
+			m_pBufferPixels[pixelIndex] = SDL_MapRGB(pFormat, static_cast<uint8_t>(values[0]), static_cast<uint8_t>(values[1]), static_cast<uint8_t>(values[2]));
+		}
+	}
+}
+
+//Only called once GetSIMDLevel() reported AVX2, returns the first pixel of the ones that don't fill a register
+DAE_TARGET_AVX2 size_t dae::Renderer::ResolvePixels8(size_t firstPixel, size_t endPixel) const
+{
+	static_assert(sizeof(ColorRGB) == 3 * sizeof(float), "the channels get gathered straight out of the buffer");
+
+	const SDL_PixelFormat* pFormat{ m_pBuffer->format };
+
+	const float quantizeScale{ m_SRGBEnabled ? SRGBTableSize - 1.f : 255.f };
+	const float quantizeBias{ m_SRGBEnabled ? 0.5f : 0.f };
+
+	size_t pixelIndex{ firstPixel };
+
+	const __m256i channelOffsets{ _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21) };
+	const __m256 zero{ _mm256_setzero_ps() };
+	const __m256 one{ _mm256_set1_ps(1.f) };
+	const __m256 scale{ _mm256_set1_ps(quantizeScale) };
+	const __m256 bias{ _mm256_set1_ps(quantizeBias) };
+	const __m256i alpha{ _mm256_set1_epi32(static_cast<int>(pFormat->Amask)) };
+	const __m128i shifts[3]{ _mm_cvtsi32_si128(pFormat->Rshift), _mm_cvtsi32_si128(pFormat->Gshift), _mm_cvtsi32_si128(pFormat->Bshift) };
+
+	for (; pixelIndex + 8 <= endPixel; pixelIndex += 8)
+	{
+		const float* pColors{ &m_AccumulationBuffer[pixelIndex].r };
+
+		__m256 channels[3]{
+			_mm256_i32gather_ps(pColors, channelOffsets, 4),
+			_mm256_i32gather_ps(pColors + 1, channelOffsets, 4),
+			_mm256_i32gather_ps(pColors + 2, channelOffsets, 4) };
+
+		switch (m_CurrentToneMapping)
+		{
+		case ToneMapping::MaxToOne:
+		{
+			//dividing by 1 leaves the colors that already fit untouched, like ColorRGB::MaxToOne
+			const __m256 divisor{ _mm256_max_ps(_mm256_max_ps(channels[0], _mm256_max_ps(channels[1], channels[2])), one) };
+
+			for (__m256& channel : channels) channel = _mm256_div_ps(channel, divisor);
+			break;
+		}
+		case ToneMapping::Reinhard:
+			for (__m256& channel : channels) channel = _mm256_div_ps(channel, _mm256_add_ps(channel, one));
+			break;
+		case ToneMapping::ACES:
+			for (__m256& channel : channels)
+			{
+				const __m256 numerator{ _mm256_mul_ps(channel, _mm256_add_ps(_mm256_mul_ps(channel, _mm256_set1_ps(2.51f)), _mm256_set1_ps(0.03f))) };
+				const __m256 denominator{ _mm256_add_ps(_mm256_mul_ps(channel, _mm256_add_ps(_mm256_mul_ps(channel, _mm256_set1_ps(2.43f)), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f)) };
+
+				channel = _mm256_div_ps(numerator, denominator);
 			}
+			break;
+		}
+
+		__m256i pixels{ alpha };
+
+		for (int channelIdx{}; channelIdx < 3; ++channelIdx)
+		{
+			const __m256 clamped{ _mm256_min_ps(_mm256_max_ps(channels[channelIdx], zero), one) };
+
+			__m256i value{ _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(clamped, scale), bias)) };
 
+			if (m_SRGBEnabled)
+			{
+				value = _mm256_i32gather_epi32(reinterpret_cast<const int*>(m_SRGBTable.data()), value, 4);
+			}
+
+			pixels = _mm256_or_si256(pixels, _mm256_sll_epi32(value, shifts[channelIdx]));
 		}
 
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(m_pBufferPixels + pixelIndex), pixels);
 	}
 
-	//Update Color in Buffer
-	finalColor.MaxToOne();
+	return pixelIndex;
+}
+
+//Brings a linear color into [0, 1], the SIMD version in ResolvePixels8 has to stay in sync with it
+ColorRGB dae::Renderer::ToneMap(const ColorRGB& color) const
+{
+	switch (m_CurrentToneMapping)
+	{
+	case ToneMapping::Reinhard:
+		return { color.r / (color.r + 1.f), color.g / (color.g + 1.f), color.b / (color.b + 1.f) };
+	case ToneMapping::ACES:
+	{
+		//Narkowicz's fit of the ACES filmic curve
+		const auto aces = [](float x)
+			{
+				return x * (x * 2.51f + 0.03f) / (x * (x * 2.43f + 0.59f) + 0.14f);
+			};
+
+		return { aces(color.r), aces(color.g), aces(color.b) };
+	}
+	default:
+	{
+		ColorRGB mappedColor{ color };
+		mappedColor.MaxToOne();
 
-	m_pBufferPixels[px + ( py * m_Width)] = SDL_MapRGB(m_pBuffer->format,
-		static_cast<uint8_t>(finalColor.r * 255),
-		static_cast<uint8_t>(finalColor.g * 255),
-		static_cast<uint8_t>(finalColor.b * 255));
+		return mappedColor;
+	}
+	}
 }
 
-bool Renderer::SaveBufferToImage() const
+bool Renderer::SaveBufferToImage(const char* filePath) const
 {
-	return SDL_SaveBMP(m_pBuffer, "RayTracing_Buffer.bmp");
+	return SDL_SaveBMP(m_pBuffer, filePath);
 }
@@ -1,45 +1,122 @@
 #pragma once
 
 #include <cstdint>
+#include <span>
 #include <vector>
 
+#include "AlignedBuffer.h"
+#include "ColorRGB.h"
+#include "Matrix.h"
+#include "TileScheduler.h"
+
 struct SDL_Window;
 struct SDL_Surface;
 
 namespace dae
 {
 	class Scene;
-	class Material;
+	struct MaterialTable;
 	struct Camera;
 	struct Light;
+	struct Ray;
+	struct Vector3;
+	struct HitRecord;
+	struct ShadingBatch;
+	enum class MaterialKind : uint8_t;
+
+	//Shadow ray state of one tile
+	struct ShadowRayCache
+	{
+		//shadingLightCount is the most lights a hit gets shaded with, sceneLightCount the size of Scene::GetLights()
+		ShadowRayCache(size_t shadingLightCount, size_t sceneLightCount)
+			: visibleLanes(shadingLightCount)
+			, lastOccluders(sceneLightCount, UINT32_MAX)
+		{
+		}
+
+		//one entry per light of the list the last batch got shaded with, bit lane is set when the light reaches the hit of that lane
+		std::vector<uint8_t> visibleLanes{};
+
+		//TLAS primitive that blocked the last shadow ray towards a light, indexed by Light::sceneIndex, UINT32_MAX when there is none yet
+		//neighbouring pixels tend to be shadowed by the same object, so it gets tested before a full traversal
+		//the many light mode picks different lights for every hit, so the position in the shading list can't be the key
+		std::vector<uint32_t> lastOccluders{};
+	};
 
 	class Renderer final
 	{
 	public:
+		//Renders straight into the surface of pWindow and shows every frame in it
 		Renderer(SDL_Window* pWindow);
-		~Renderer() = default;
+		//Headless, renders into an in memory surface of its own, no window or video subsystem needed
+		Renderer(int width, int height);
+		~Renderer();
 
 		Renderer(const Renderer&) = delete;
 		Renderer(Renderer&&) noexcept = delete;
 		Renderer& operator=(const Renderer&) = delete;
 		Renderer& operator=(Renderer&&) noexcept = delete;
 
-		void Render(Scene* pScene) const;
+		//False when the headless buffer couldn't be created, nothing else may be called then
+		bool IsValid() const { return m_pBuffer != nullptr; }
+
+		//Returns false when nothing changed since the image in the buffer converged, nothing got traced then
+		bool Render(Scene* pScene);
 
-		void RenderPixel(Scene* scenePtr, uint32_t pixelIndex, float fov, float aspectRatio, const Camera& camera, const std::vector<Light>& lights, const std::vector<Material*>& materials) const;
+		//sampledLights is scratch space for the many light mode
+		void RenderPixel(Scene* scenePtr, uint32_t pixelIndex, const Camera& camera, const std::vector<Light>& lights, const MaterialTable& materials, ShadowRayCache& shadowCache, std::vector<Light>& sampledLights);
+		void RenderTilePackets(Scene* scenePtr, const Tile& tile, const Camera& camera, const std::vector<Light>& lights, const MaterialTable& materials, ShadowRayCache& shadowCache, std::vector<Light>& sampledLights);
 
-		bool SaveBufferToImage() const;
+		bool SaveBufferToImage(const char* filePath = "RayTracing_Buffer.bmp") const;
 
-		void CycleLightingMode() { m_CurrentLightingMode = static_cast<LightingMode>((static_cast<int>(m_CurrentLightingMode) + 1) % LightingModeSize); }
+		void CycleLightingMode() { m_CurrentLightingMode = static_cast<LightingMode>((static_cast<int>(m_CurrentLightingMode) + 1) % LightingModeSize); m_AccumulatedFrames = 0; }
 
-		void ToggleShadow() { m_ShadowsEnabled = !m_ShadowsEnabled; }
+		void ToggleShadow() { m_ShadowsEnabled = !m_ShadowsEnabled; m_AccumulatedFrames = 0; }
+
+		void TogglePacketTracing() { m_PacketTracingEnabled = !m_PacketTracingEnabled; }
+
+		void ToggleManyLights() { m_ManyLightsEnabled = !m_ManyLightsEnabled; m_AccumulatedFrames = 0; }
+
+		void ToggleAdaptiveAA() { m_AdaptiveAAEnabled = !m_AdaptiveAAEnabled; m_AccumulatedFrames = 0; }
+
+		//Only change how the buffer gets resolved, a converged image is shown again without tracing it again
+		void CycleToneMapping() { m_CurrentToneMapping = static_cast<ToneMapping>((static_cast<int>(m_CurrentToneMapping) + 1) % ToneMappingSize); m_IsResolveDirty = true; }
+
+		void ToggleSRGB() { m_SRGBEnabled = !m_SRGBEnabled; m_IsResolveDirty = true; }
 
 		bool getCameraLock() const { return m_IsCamLocked; }
 
 		void SetCameraLock(bool expression) { m_IsCamLocked = expression; }
 
+		void SetTileSize(int tileWidth, int tileHeight) { m_TileWidth = tileWidth; m_TileHeight = tileHeight; }
+
 	private:
 
+		void InitializeBuffers();
+
+		Ray GetViewRay(uint32_t pixelIndex, const Camera& camera) const;
+		void UpdateViewRays(float fov, const Camera& camera);
+		void RotateViewRays4(size_t firstPixel, size_t endPixel, const Matrix& cameraToWorld);
+		void RotateViewRays8(size_t firstPixel, size_t endPixel, const Matrix& cameraToWorld);
+		Vector3 GetViewDirection(float x, float y, float fov, const Camera& camera) const;
+		void CullLights(const Tile& tile, float fov, const Camera& camera, const std::vector<Light>& lights, std::vector<Light>& tileLights) const;
+		void TraceShadowRays(const Scene* scenePtr, HitRecord hits[], int hitCount, const std::vector<Light>& lights, ShadowRayCache& shadowCache) const;
+		void RefineEdges(Scene* scenePtr, float fov, const Camera& camera, const std::vector<Light>& lights, const MaterialTable& materials);
+		void RefinePixel(Scene* scenePtr, uint32_t pixelIndex, float fov, const Camera& camera, const std::vector<Light>& lights, const MaterialTable& materials, ShadowRayCache& shadowCache, std::vector<Light>& sampledLights);
+		void ResolveFrame(bool hasNewFrame);
+		void AccumulatePixels(size_t firstPixel, size_t endPixel);
+		void ResolvePixels(size_t firstPixel, size_t endPixel, bool canPack) const;
+		size_t ResolvePixels8(size_t firstPixel, size_t endPixel) const;
+		ColorRGB ToneMap(const ColorRGB& color) const;
+		ColorRGB TraceSample(const Scene* scenePtr, const Ray& viewRay, uint32_t seed, const std::vector<Light>& lights, const MaterialTable& materials, ShadowRayCache& shadowCache, std::vector<Light>& sampledLights, bool& isSampled) const;
+		const std::vector<Light>& SampleLights(const Scene* scenePtr, const Vector3& position, uint32_t seed, const std::vector<Light>& lights, std::vector<Light>& sampledLights) const;
+		ColorRGB ShadeHit(const Ray& viewRay, const HitRecord& closestHit, const std::vector<Light>& lights, const MaterialTable& materials, const std::vector<uint8_t>& visibleLanes, int lane) const;
+		void ShadeBatch(const ShadingBatch& batch, const std::vector<Light>& lights, const MaterialTable& materials);
+		template<typename MaterialType>
+		void ShadeBucket(const ShadingBatch& batch, MaterialKind kind, const std::vector<Light>& lights, const std::vector<uint32_t>& parameterIndices, const std::vector<typename MaterialType::Parameters>& parameterArray);
+		template<typename MaterialType>
+		ColorRGB ShadeLights(const Vector3& viewDirection, const HitRecord& closestHit, std::span<const Light> lights, const typename MaterialType::Parameters& parameters, std::span<const uint8_t> visibleLanes, int lane) const;
+
 		enum class LightingMode
 		{
 			ObservedArea,
@@ -52,9 +129,69 @@ namespace dae
 
 		LightingMode m_CurrentLightingMode{ LightingMode::Combined };
 
+		//MaxToOne scales a color down until its brightest channel fits, the others compress every channel on its own
+		enum class ToneMapping
+		{
+			MaxToOne,
+			Reinhard,
+			ACES,
+		};
+
+		const int ToneMappingSize = 3;
+
+		ToneMapping m_CurrentToneMapping{ ToneMapping::MaxToOne };
+
+		//the scenes pick their colors for the screen, so encoding them as sRGB is opt in
+		bool m_SRGBEnabled{ false };
+		bool m_IsResolveDirty{ false };
+
+		//8 bit sRGB value of every 12 bit linear value, packing looks them up instead of calling pow per channel
+		static constexpr uint32_t SRGBTableSize{ 4096 };
+		std::vector<uint32_t> m_SRGBTable{};
+
 		bool m_ShadowsEnabled{ true };
+		bool m_PacketTracingEnabled{ true };
+
+		//Many light mode, every hit gets shaded by m_LightSampleCount point lights picked from the light BVH
+		//the noise averages out over the frames the camera stands still
+		bool m_ManyLightsEnabled{ false };
+		uint32_t m_LightSampleCount{ 4 };
+		uint32_t m_FrameIndex{};
+
+		//Frames in the buffer since the view last changed, rendering stops once it reaches 1, or m_MaxAccumulatedFrames in the many light mode
+		uint32_t m_AccumulatedFrames{};
+		uint32_t m_MaxAccumulatedFrames{ 256 };
+		//linear color of every pixel averaged over those frames, the only thing ResolveFrame reads
+		std::vector<ColorRGB> m_AccumulationBuffer{};
+		//set for pixels whose shading has no randomness in it, they are done after the first frame
+		std::vector<uint8_t> m_ConvergedPixels{};
+		//unclamped color of every pixel for the current frame, ResolveFrame blends it into m_AccumulationBuffer
+		std::vector<ColorRGB> m_FrameColors{};
+		Matrix m_LastCameraToWorld{};
+		float m_LastFovAngle{};
+
+		//Adaptive anti-aliasing, pixels that differ from a neighbour by more than m_AAContrastThreshold in any channel get extra samples
+		//at least m_AAMinSamples, and up to m_AAMaxSamples (the center and all 8 offsets) while the standard error of their mean stays above m_AAErrorThreshold
+		//m_AASampleBudget caps the extra rays per frame, the pixels with the highest contrast go first
+		struct EdgePixel
+		{
+			uint32_t pixelIndex{};
+			float contrast{};
+		};
+
+		bool m_AdaptiveAAEnabled{ true };
+		float m_AAContrastThreshold{ 0.1f };
+		float m_AAErrorThreshold{ 0.01f };
+		uint32_t m_AAMinSamples{ 4 };
+		uint32_t m_AAMaxSamples{ 9 };
+		uint32_t m_AASampleBudget{};
+		std::vector<ColorRGB> m_DisplayColors{};
+		std::vector<EdgePixel> m_EdgePixels{};
+		//edge pixels found in every row, merged into m_EdgePixels, kept around so the rows don't allocate every frame
+		std::vector<std::vector<EdgePixel>> m_RowEdgePixels{};
 		bool m_IsCamLocked{ true };
 
+		//nullptr when headless, m_pBuffer is owned by the renderer then
 		SDL_Window* m_pWindow{};
 
 		SDL_Surface* m_pBuffer{};
@@ -65,5 +202,18 @@ namespace dae
 
 		float m_AspectRatio{};
 
+		//Direction through the center of every pixel, in camera space it only depends on the fov since the resolution is fixed
+		//every frame rotates them into world space in one pass, so primary rays need no divisions, matrix call or square root
+		AlignedBuffer<float> m_CameraRayX{}, m_CameraRayY{}, m_CameraRayZ{};
+		AlignedBuffer<float> m_ViewRayX{}, m_ViewRayY{}, m_ViewRayZ{};
+		//0 until the first frame builds the camera space directions
+		float m_ViewRayFov{};
+
+		//small square tiles keep the rays of one thread close together, so they keep hitting the same BVH nodes
+		int m_TileWidth{ 16 };
+		int m_TileHeight{ 16 };
+
+		TileScheduler m_TileScheduler{ ThreadPool::GetShared() };
+
 	};
 }
@@ -2,6 +2,7 @@
 #include "Utils.h"
 #include "Material.h"
 #include <iostream>
+#include <algorithm>
 
 namespace dae {
 
@@ -13,7 +14,10 @@ namespace dae {
 		m_SphereGeometries.reserve(32);
 		m_PlaneGeometries.reserve(32);
 		m_TriangleMeshGeometries.reserve(32);
+		m_TriangleMeshInstances.reserve(32);
 		m_Lights.reserve(32);
+
+		m_pMaterials.front()->AddTo(m_MaterialTable);
 	}
 
 	Scene::~Scene()
@@ -31,69 +35,719 @@ namespace dae {
 
 	void dae::Scene::GetClosestHit(const Ray& ray, HitRecord& closestHit) const
 	{
+		//only t and the primitive are tracked during traversal, the full hit gets built once at the end
+		HitCandidate candidate{};
+		candidate.t = closestHit.t;
+
+		HitTest_Planes(ray, candidate);
+
+		TraceClosestHit(ray, candidate);
 
-		HitRecord tempHit{};
-		
-		for (int i{}; i < m_SphereGeometries.size(); ++i)
+		if (candidate.DidHit())
 		{
-			if (GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray, tempHit))
+			FinalizeHit(ray, candidate, closestHit);
+		}
+	}
+
+	void Scene::TraceClosestHit(const Ray& ray, HitCandidate& candidate) const
+	{
+		if (m_TLASNodes.empty()) return;
+
+		//Median splits keep the depth at log2(primitives), 64 is plenty
+		GeometryUtils::BVHStackEntry nodeStack[64];
+		size_t stackSize{};
+
+		const float tRoot{ GeometryUtils::SlabTest_Distance(ray, m_TLASNodes[0].minAABB, m_TLASNodes[0].maxAABB) };
+
+		if (tRoot != FLT_MAX) nodeStack[stackSize++] = { 0, tRoot };
+
+		while (stackSize > 0)
+		{
+			const GeometryUtils::BVHStackEntry entry{ nodeStack[--stackSize] };
+
+			//the closest hit might have moved in front of this node since it got pushed
+			if (entry.tEntry > std::min(candidate.t, ray.max)) continue;
+
+			const TLASNode& node{ m_TLASNodes[entry.nodeIdx] };
+
+			if (node.IsLeaf())
 			{
-				if(tempHit.t <  closestHit.t)
+				for (size_t i{ node.firstPrimitive }; i < node.firstPrimitive + node.primitiveCount; ++i)
 				{
-					closestHit = tempHit;
+					HitTest_TLASPrimitive(m_TLASPrimitives[i], ray, candidate);
 				}
 			}
+			else
+			{
+				const uint32_t leftChildIdx{ static_cast<uint32_t>(node.leftNode) };
+				const uint32_t rightChildIdx{ leftChildIdx + 1 };
+
+				const float tLeft{ GeometryUtils::SlabTest_Distance(ray, m_TLASNodes[leftChildIdx].minAABB, m_TLASNodes[leftChildIdx].maxAABB) };
+				const float tRight{ GeometryUtils::SlabTest_Distance(ray, m_TLASNodes[rightChildIdx].minAABB, m_TLASNodes[rightChildIdx].maxAABB) };
+
+				//far child first so the near one gets popped first
+				if (tLeft <= tRight)
+				{
+					if (tRight != FLT_MAX) nodeStack[stackSize++] = { rightChildIdx, tRight };
+					if (tLeft != FLT_MAX) nodeStack[stackSize++] = { leftChildIdx, tLeft };
+				}
+				else
+				{
+					if (tLeft != FLT_MAX) nodeStack[stackSize++] = { leftChildIdx, tLeft };
+					if (tRight != FLT_MAX) nodeStack[stackSize++] = { rightChildIdx, tRight };
+				}
+			}
+		}
+
+	}
+
+	void Scene::GetClosestHitPacket(const RayPacket& packet, HitRecord closestHits[RayPacket::Size]) const
+	{
+		//rays heading into different octants don't agree on a traversal order, trace them one by one
+		if (!packet.IsCoherent())
+		{
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				GetClosestHit(packet.rays[lane], closestHits[lane]);
+			}
+
+			return;
+		}
+
+		HitCandidate candidates[RayPacket::Size]{};
+
+		for (int lane{}; lane < RayPacket::Size; ++lane)
+		{
+			candidates[lane].t = closestHits[lane].t;
+
+			HitTest_Planes(packet.rays[lane], candidates[lane]);
 		}
 
-		for (int i{}; i < m_PlaneGeometries.size(); ++i)
+		TraceClosestHitPacket(packet, candidates);
+
+		for (int lane{}; lane < RayPacket::Size; ++lane)
 		{
-			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[i], ray, tempHit))
+			if (candidates[lane].DidHit())
 			{
-				if (tempHit.t < closestHit.t)
+				FinalizeHit(packet.rays[lane], candidates[lane], closestHits[lane]);
+			}
+		}
+	}
+
+	void Scene::TraceClosestHitPacket(const RayPacket& packet, HitCandidate candidates[RayPacket::Size]) const
+	{
+		if (m_TLASNodes.empty()) return;
+
+		const GeometryUtils::RayPacketSoA packetSoA{ packet };
+		const Vector3& direction{ packet.rays[0].direction };
+
+		alignas(16) float maxT[RayPacket::Size]{};
+
+		for (int lane{}; lane < RayPacket::Size; ++lane)
+		{
+			maxT[lane] = std::min(candidates[lane].t, packet.rays[lane].max);
+		}
+
+		uint32_t nodeStack[64];
+		size_t stackSize{};
+
+		nodeStack[stackSize++] = 0;
+
+		while (stackSize > 0)
+		{
+			const TLASNode& node{ m_TLASNodes[nodeStack[--stackSize]] };
+
+			const int hitMask{ GeometryUtils::SlabTest_Packet(node.minAABB, node.maxAABB, packetSoA, _mm_load_ps(maxT)) };
+
+			if (hitMask == 0) continue;
+
+			if (node.IsLeaf())
+			{
+				for (size_t i{ node.firstPrimitive }; i < node.firstPrimitive + node.primitiveCount; ++i)
+				{
+					HitTest_TLASPrimitivePacket(m_TLASPrimitives[i], packet, candidates, hitMask);
+				}
+
+				for (int lane{}; lane < RayPacket::Size; ++lane)
+				{
+					maxT[lane] = std::min(candidates[lane].t, packet.rays[lane].max);
+				}
+			}
+			else
+			{
+				const uint32_t leftChildIdx{ static_cast<uint32_t>(node.leftNode) };
+				const uint32_t rightChildIdx{ leftChildIdx + 1 };
+
+				const TLASNode& leftChild{ m_TLASNodes[leftChildIdx] };
+				const TLASNode& rightChild{ m_TLASNodes[rightChildIdx] };
+
+				const Vector3 leftToRight{ (rightChild.minAABB + rightChild.maxAABB) - (leftChild.minAABB + leftChild.maxAABB) };
+
+				//far child first so the near one gets popped first
+				if (Vector3::Dot(leftToRight, direction) >= 0.f)
 				{
-					closestHit = tempHit;
+					nodeStack[stackSize++] = rightChildIdx;
+					nodeStack[stackSize++] = leftChildIdx;
+				}
+				else
+				{
+					nodeStack[stackSize++] = leftChildIdx;
+					nodeStack[stackSize++] = rightChildIdx;
 				}
 			}
 		}
+	}
 
-		for (int i{}; i < m_TriangleMeshGeometries.size(); ++i)
+	void Scene::HitTest_Planes(const Ray& ray, HitCandidate& candidate) const
+	{
+		for (size_t i{}; i < m_PlaneGeometries.size(); ++i)
 		{
-			if (GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[i], ray, tempHit))
+			float t{};
+
+			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[i], ray, t) && t < candidate.t)
 			{
-				if (tempHit.t < closestHit.t)
+				candidate = {};
+				candidate.t = t;
+				candidate.primitiveIdx = static_cast<uint32_t>(i);
+				candidate.type = HitPrimitiveType::Plane;
+				candidate.materialIndex = m_PlaneGeometries[i].materialIndex;
+			}
+		}
+	}
+
+	void Scene::FinalizeHit(const Ray& ray, const HitCandidate& candidate, HitRecord& hitRecord) const
+	{
+		switch (candidate.type)
+		{
+		case HitPrimitiveType::Plane:
+			hitRecord.didHit = true;
+			hitRecord.materialIndex = candidate.materialIndex;
+			hitRecord.origin = ray.origin + (ray.direction * candidate.t);
+			hitRecord.normal = m_PlaneGeometries[candidate.primitiveIdx].normal;
+			hitRecord.t = candidate.t;
+			break;
+		case HitPrimitiveType::Sphere:
+			hitRecord.didHit = true;
+			hitRecord.materialIndex = candidate.materialIndex;
+			hitRecord.origin = ray.origin + (ray.direction * candidate.t);
+			hitRecord.normal = (hitRecord.origin - m_Spheres.GetOrigin(candidate.primitiveIdx)).Normalized();
+			hitRecord.t = candidate.t;
+			break;
+		case HitPrimitiveType::Triangle:
+			GeometryUtils::FinalizeTriangleHit(candidate, ray, hitRecord);
+			break;
+		default:
+			break;
+		}
+	}
+
+	bool Scene::HitTest_TLASPrimitive(const TLASPrimitive& primitive, const Ray& ray, HitCandidate& candidate) const
+	{
+		switch (primitive.type)
+		{
+		case TLASPrimitiveType::SphereGroup:
+		{
+			const SphereGroup& group{ m_SphereGroups[primitive.index] };
+			return GeometryUtils::HitTest_Spheres(m_Spheres, group.firstSphere, group.sphereCount, ray, candidate);
+		}
+		case TLASPrimitiveType::TriangleMesh:
+		{
+			const TriangleMesh& mesh{ m_TriangleMeshGeometries[primitive.index] };
+			return GeometryUtils::HitTest_TriangleMesh(mesh, mesh.cullMode, mesh.materialIndex, ray, candidate);
+		}
+		case TLASPrimitiveType::TriangleMeshInstance:
+			return GeometryUtils::HitTest_TriangleMeshInstance(m_TriangleMeshInstances[primitive.index], ray, candidate);
+		default:
+			return false;
+		}
+	}
+
+	int Scene::OccludedPacket(const RayPacket& packet, int laneMask, uint32_t occluderHints[RayPacket::Size]) const
+	{
+		int occludedMask{};
+
+		for (const Plane& plane : m_PlaneGeometries)
+		{
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				if ((laneMask & (1 << lane)) && GeometryUtils::HitTest_Plane(plane, packet.rays[lane])) occludedMask |= 1 << lane;
+			}
+		}
+
+		laneMask &= ~occludedMask;
+
+		if (laneMask == 0 || m_TLASNodes.empty()) return occludedMask;
+
+		//the primitive that blocked the previous ray of a lane is the most likely one to block this one too
+		if (occluderHints)
+		{
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				if (!(laneMask & (1 << lane)) || occluderHints[lane] >= m_TLASPrimitives.size()) continue;
+
+				if (Occluded_TLASPrimitive(m_TLASPrimitives[occluderHints[lane]], packet.rays[lane])) occludedMask |= 1 << lane;
+			}
+
+			laneMask &= ~occludedMask;
+
+			if (laneMask == 0) return occludedMask;
+		}
+
+		//any occluder will do, so unlike the closest hit traversal the rays don't have to agree on a visiting order
+		const GeometryUtils::RayPacketSoA packetSoA{ packet };
+
+		alignas(16) float maxT[RayPacket::Size]{};
+
+		for (int lane{}; lane < RayPacket::Size; ++lane)
+		{
+			maxT[lane] = packet.rays[lane].max;
+		}
+
+		const __m128 maxTs{ _mm_load_ps(maxT) };
+
+		uint32_t nodeStack[64];
+		size_t stackSize{};
+
+		nodeStack[stackSize++] = 0;
+
+		while (stackSize > 0)
+		{
+			const TLASNode& node{ m_TLASNodes[nodeStack[--stackSize]] };
+
+			//lanes that are already occluded are done
+			int hitMask{ GeometryUtils::SlabTest_Packet(node.minAABB, node.maxAABB, packetSoA, maxTs) & laneMask };
+
+			if (hitMask == 0) continue;
+
+			if (node.IsLeaf())
+			{
+				for (size_t i{ node.firstPrimitive }; i < node.firstPrimitive + node.primitiveCount && hitMask != 0; ++i)
 				{
-					closestHit = tempHit;
+					for (int lane{}; lane < RayPacket::Size; ++lane)
+					{
+						if (!(hitMask & (1 << lane))) continue;
+
+						if (Occluded_TLASPrimitive(m_TLASPrimitives[i], packet.rays[lane]))
+						{
+							occludedMask |= 1 << lane;
+							hitMask &= ~(1 << lane);
+
+							if (occluderHints) occluderHints[lane] = static_cast<uint32_t>(i);
+						}
+					}
 				}
+
+				laneMask &= ~occludedMask;
+
+				if (laneMask == 0) return occludedMask;
+			}
+			else
+			{
+				const uint32_t leftChildIdx{ static_cast<uint32_t>(node.leftNode) };
+
+				nodeStack[stackSize++] = leftChildIdx + 1;
+				nodeStack[stackSize++] = leftChildIdx;
+			}
+		}
+
+		return occludedMask;
+	}
+
+	bool Scene::Occluded_TLASPrimitive(const TLASPrimitive& primitive, const Ray& ray) const
+	{
+		switch (primitive.type)
+		{
+		case TLASPrimitiveType::SphereGroup:
+		{
+			const SphereGroup& group{ m_SphereGroups[primitive.index] };
+			return GeometryUtils::Occluded_Spheres(m_Spheres, group.firstSphere, group.sphereCount, ray);
+		}
+		case TLASPrimitiveType::TriangleMesh:
+		{
+			const TriangleMesh& mesh{ m_TriangleMeshGeometries[primitive.index] };
+			return GeometryUtils::Occluded_TriangleMesh(mesh, mesh.cullMode, ray);
+		}
+		case TLASPrimitiveType::TriangleMeshInstance:
+			return GeometryUtils::Occluded_TriangleMeshInstance(m_TriangleMeshInstances[primitive.index], ray);
+		default:
+			return false;
+		}
+	}
+
+	void Scene::HitTest_TLASPrimitivePacket(const TLASPrimitive& primitive, const RayPacket& packet, HitCandidate candidates[RayPacket::Size], int laneMask) const
+	{
+		switch (primitive.type)
+		{
+		case TLASPrimitiveType::SphereGroup:
+		{
+			const SphereGroup& group{ m_SphereGroups[primitive.index] };
+
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				if (!(laneMask & (1 << lane))) continue;
+
+				GeometryUtils::HitTest_Spheres(m_Spheres, group.firstSphere, group.sphereCount, packet.rays[lane], candidates[lane]);
 			}
 		}
+		break;
+		case TLASPrimitiveType::TriangleMesh:
+			GeometryUtils::HitTest_TriangleMeshPacket(m_TriangleMeshGeometries[primitive.index], packet, candidates, laneMask);
+			break;
+		case TLASPrimitiveType::TriangleMeshInstance:
+			GeometryUtils::HitTest_TriangleMeshInstancePacket(m_TriangleMeshInstances[primitive.index], packet, candidates, laneMask);
+			break;
+		default:
+			break;
+		}
+	}
 
+#pragma region Top Level BVH
+	void Scene::UpdateTopLevelBVH()
+	{
+		if (m_IsTopLevelBVHDirty) BuildTopLevelBVH();
 	}
 
-	bool Scene::DoesHit(const Ray& ray) const
+	void Scene::BuildTopLevelBVH()
 	{
+		m_IsTopLevelBVHDirty = false;
+
+		BuildSphereGroups();
+
+		m_TLASPrimitives.clear();
+		m_TLASPrimitives.reserve(m_SphereGroups.size() + m_TriangleMeshGeometries.size() + m_TriangleMeshInstances.size());
 
-		for (int i = 0; i < m_SphereGeometries.size(); ++i)
+		for (size_t i{}; i < m_SphereGroups.size(); ++i)
 		{
+			const SphereGroup& group{ m_SphereGroups[i] };
+
+			TLASPrimitive primitive{};
+
+			for (size_t sphereIdx{ group.firstSphere }; sphereIdx < group.firstSphere + group.sphereCount; ++sphereIdx)
+			{
+				const Sphere& sphere{ m_SphereGeometries[m_SphereOrder[sphereIdx]] };
+				const Vector3 radius{ Vector3::Identity * sphere.radius };
 
-			if (GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray)) return true;
+				primitive.bounds.Grow(sphere.origin - radius);
+				primitive.bounds.Grow(sphere.origin + radius);
+			}
 
-		} 
+			primitive.center = (primitive.bounds.min + primitive.bounds.max) * 0.5f;
+			primitive.type = TLASPrimitiveType::SphereGroup;
+			primitive.index = i;
 
-		for (int i = 0; i < m_PlaneGeometries.size(); ++i)
+			m_TLASPrimitives.emplace_back(primitive);
+		}
+
+		for (size_t i{}; i < m_TriangleMeshGeometries.size(); ++i)
 		{
+			const TriangleMesh& mesh{ m_TriangleMeshGeometries[i] };
 
-			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[i], ray)) return true;
+			TLASPrimitive primitive{};
+			primitive.bounds.min = mesh.transformedMinAABB;
+			primitive.bounds.max = mesh.transformedMaxAABB;
+			primitive.center = (mesh.transformedMinAABB + mesh.transformedMaxAABB) * 0.5f;
+			primitive.type = TLASPrimitiveType::TriangleMesh;
+			primitive.index = i;
 
+			m_TLASPrimitives.emplace_back(primitive);
 		}
 
-		for (int i = 0; i < m_TriangleMeshGeometries.size(); ++i)
+		for (size_t i{}; i < m_TriangleMeshInstances.size(); ++i)
 		{
+			const TriangleMeshInstance& instance{ m_TriangleMeshInstances[i] };
+
+			TLASPrimitive primitive{};
+			primitive.bounds.min = instance.transformedMinAABB;
+			primitive.bounds.max = instance.transformedMaxAABB;
+			primitive.center = (instance.transformedMinAABB + instance.transformedMaxAABB) * 0.5f;
+			primitive.type = TLASPrimitiveType::TriangleMeshInstance;
+			primitive.index = i;
 
-			if (GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[i], ray)) return true;
+			m_TLASPrimitives.emplace_back(primitive);
 		}
 
-		return false;
+		m_TLASNodes.clear();
+
+		if (m_TLASPrimitives.empty()) return;
+
+		//A binary tree with N leaves never needs more than 2N - 1 nodes
+		m_TLASNodes.reserve(m_TLASPrimitives.size() * 2 - 1);
+
+		TLASNode root{};
+		root.firstPrimitive = 0;
+		root.primitiveCount = m_TLASPrimitives.size();
+
+		m_TLASNodes.emplace_back(root);
+
+		UpdateTLASNodeBounds(0);
+
+		SubdivideTLAS(0);
+	}
+
+	//Sorts the spheres into spatially close groups and lays them out in that order in the SoA store
+	void Scene::BuildSphereGroups()
+	{
+		const size_t sphereCount{ m_SphereGeometries.size() };
+
+		m_SphereOrder.resize(sphereCount);
+
+		for (size_t i{}; i < sphereCount; ++i)
+		{
+			m_SphereOrder[i] = i;
+		}
+
+		m_SphereGroups.clear();
+
+		if (sphereCount > 0)
+		{
+			SubdivideSphereGroup(0, sphereCount);
+		}
+
+		m_Spheres.Resize(sphereCount);
+
+		for (size_t i{}; i < sphereCount; ++i)
+		{
+			m_Spheres.Set(i, m_SphereGeometries[m_SphereOrder[i]]);
+		}
+	}
+
+	void Scene::SubdivideSphereGroup(size_t firstSphere, size_t sphereCount)
+	{
+		if (sphereCount <= SphereGroup::maxSize)
+		{
+			m_SphereGroups.push_back({ firstSphere, sphereCount });
+			return;
+		}
+
+		//same median split as the top level BVH, only rounded so the left side fills whole groups
+		AABB centerBounds{};
+
+		for (size_t i{ firstSphere }; i < firstSphere + sphereCount; ++i)
+		{
+			centerBounds.Grow(m_SphereGeometries[m_SphereOrder[i]].origin);
+		}
+
+		const Vector3 extent{ centerBounds.max - centerBounds.min };
+
+		int axis{ 0 };
+		if (extent.y > extent[axis]) axis = 1;
+		if (extent.z > extent[axis]) axis = 2;
+
+		const size_t leftCount{ (sphereCount / 2 + SphereGroup::maxSize - 1) / SphereGroup::maxSize * SphereGroup::maxSize };
+
+		const auto first{ m_SphereOrder.begin() + firstSphere };
+
+		std::nth_element(first, first + leftCount, first + sphereCount,
+			[this, axis](size_t a, size_t b) { return m_SphereGeometries[a].origin[axis] < m_SphereGeometries[b].origin[axis]; });
+
+		SubdivideSphereGroup(firstSphere, leftCount);
+		SubdivideSphereGroup(firstSphere + leftCount, sphereCount - leftCount);
+	}
+
+	void Scene::UpdateTLASNodeBounds(size_t nodeIdx)
+	{
+		TLASNode& node{ m_TLASNodes[nodeIdx] };
+
+		AABB bounds{};
+
+		for (size_t i{ node.firstPrimitive }; i < node.firstPrimitive + node.primitiveCount; ++i)
+		{
+			bounds.Grow(m_TLASPrimitives[i].bounds);
+		}
+
+		node.minAABB = bounds.min;
+		node.maxAABB = bounds.max;
+	}
+
+	void Scene::SubdivideTLAS(size_t nodeIdx)
+	{
+		const size_t primitiveCount{ m_TLASNodes[nodeIdx].primitiveCount };
+
+		if (primitiveCount <= 2) return;
+
+		const size_t firstPrimitive{ m_TLASNodes[nodeIdx].firstPrimitive };
+
+		//split along the longest axis of the centers, rebuilt every frame so a median split is cheaper than SAH here
+		AABB centerBounds{};
+
+		for (size_t i{ firstPrimitive }; i < firstPrimitive + primitiveCount; ++i)
+		{
+			centerBounds.Grow(m_TLASPrimitives[i].center);
+		}
+
+		const Vector3 extent{ centerBounds.max - centerBounds.min };
+
+		int axis{ 0 };
+		if (extent.y > extent[axis]) axis = 1;
+		if (extent.z > extent[axis]) axis = 2;
+
+		const size_t leftCount{ primitiveCount / 2 };
+
+		const auto first{ m_TLASPrimitives.begin() + firstPrimitive };
+
+		std::nth_element(first, first + leftCount, first + primitiveCount,
+			[axis](const TLASPrimitive& a, const TLASPrimitive& b) { return a.center[axis] < b.center[axis]; });
+
+		//create childnodes, emplace_back can reallocate so no references are kept past this point
+		const size_t leftChildIdx{ m_TLASNodes.size() };
+
+		TLASNode leftChild{};
+		leftChild.firstPrimitive = firstPrimitive;
+		leftChild.primitiveCount = leftCount;
+
+		TLASNode rightChild{};
+		rightChild.firstPrimitive = firstPrimitive + leftCount;
+		rightChild.primitiveCount = primitiveCount - leftCount;
+
+		m_TLASNodes.emplace_back(leftChild);
+		m_TLASNodes.emplace_back(rightChild);
+
+		m_TLASNodes[nodeIdx].leftNode = leftChildIdx;
+		m_TLASNodes[nodeIdx].primitiveCount = 0;
+
+		UpdateTLASNodeBounds(leftChildIdx);
+		UpdateTLASNodeBounds(leftChildIdx + 1);
+
+		SubdivideTLAS(leftChildIdx);
+		SubdivideTLAS(leftChildIdx + 1);
+	}
+#pragma endregion
+
+#pragma region Light BVH
+	void Scene::BuildLightBVH()
+	{
+		m_LightBVHOrder.clear();
+
+		for (size_t i{}; i < m_Lights.size(); ++i)
+		{
+			if (m_Lights[i].type == LightType::Point && LightUtils::GetPower(m_Lights[i]) > 0.f)
+			{
+				m_LightBVHOrder.push_back(i);
+			}
+		}
+
+		m_LightBVHNodes.clear();
+
+		if (m_LightBVHOrder.empty()) return;
+
+		m_LightBVHNodes.reserve(m_LightBVHOrder.size() * 2 - 1);
+
+		LightBVHNode root{};
+		root.firstLight = 0;
+		root.lightCount = m_LightBVHOrder.size();
+
+		m_LightBVHNodes.emplace_back(root);
+
+		UpdateLightBVHNode(0);
+
+		SubdivideLightBVH(0);
+	}
+
+	int Scene::SampleLight(const Vector3& position, float random, float& pdf) const
+	{
+		pdf = 0.f;
+
+		if (m_LightBVHNodes.empty()) return -1;
+
+		//walk down picking a child with a probability proportional to its importance, random gets rescaled for the next pick
+		size_t nodeIdx{};
+		float probability{ 1.f };
+
+		while (!m_LightBVHNodes[nodeIdx].IsLeaf())
+		{
+			const size_t leftChildIdx{ m_LightBVHNodes[nodeIdx].leftNode };
+
+			const float leftImportance{ LightUtils::GetImportance(m_LightBVHNodes[leftChildIdx], position) };
+			const float rightImportance{ LightUtils::GetImportance(m_LightBVHNodes[leftChildIdx + 1], position) };
+
+			const float leftProbability{ leftImportance / (leftImportance + rightImportance) };
+
+			if (random < leftProbability)
+			{
+				random /= leftProbability;
+				probability *= leftProbability;
+				nodeIdx = leftChildIdx;
+			}
+			else
+			{
+				random = (random - leftProbability) / (1.f - leftProbability);
+				probability *= 1.f - leftProbability;
+				nodeIdx = leftChildIdx + 1;
+			}
+
+			random = std::min(random, 0.99999994f);
+		}
+
+		pdf = probability;
+
+		return static_cast<int>(m_LightBVHOrder[m_LightBVHNodes[nodeIdx].firstLight]);
+	}
+
+	void Scene::UpdateLightBVHNode(size_t nodeIdx)
+	{
+		LightBVHNode& node{ m_LightBVHNodes[nodeIdx] };
+
+		AABB bounds{};
+		float power{};
+
+		for (size_t i{ node.firstLight }; i < node.firstLight + node.lightCount; ++i)
+		{
+			const Light& light{ m_Lights[m_LightBVHOrder[i]] };
+
+			bounds.Grow(light.origin);
+			power += LightUtils::GetPower(light);
+		}
+
+		node.minAABB = bounds.min;
+		node.maxAABB = bounds.max;
+		node.power = power;
+	}
+
+	void Scene::SubdivideLightBVH(size_t nodeIdx)
+	{
+		const size_t lightCount{ m_LightBVHNodes[nodeIdx].lightCount };
+
+		if (lightCount <= 1) return;
+
+		const size_t firstLight{ m_LightBVHNodes[nodeIdx].firstLight };
+
+		//lights are points, so the node bounds are the bounds of the centers
+		const Vector3 extent{ m_LightBVHNodes[nodeIdx].maxAABB - m_LightBVHNodes[nodeIdx].minAABB };
+
+		int axis{ 0 };
+		if (extent.y > extent[axis]) axis = 1;
+		if (extent.z > extent[axis]) axis = 2;
+
+		const size_t leftCount{ lightCount / 2 };
+
+		const auto first{ m_LightBVHOrder.begin() + firstLight };
+
+		std::nth_element(first, first + leftCount, first + lightCount,
+			[this, axis](size_t a, size_t b) { return m_Lights[a].origin[axis] < m_Lights[b].origin[axis]; });
+
+		const size_t leftChildIdx{ m_LightBVHNodes.size() };
+
+		LightBVHNode leftChild{};
+		leftChild.firstLight = firstLight;
+		leftChild.lightCount = leftCount;
+
+		LightBVHNode rightChild{};
+		rightChild.firstLight = firstLight + leftCount;
+		rightChild.lightCount = lightCount - leftCount;
+
+		m_LightBVHNodes.emplace_back(leftChild);
+		m_LightBVHNodes.emplace_back(rightChild);
+
+		m_LightBVHNodes[nodeIdx].leftNode = leftChildIdx;
+		m_LightBVHNodes[nodeIdx].lightCount = 0;
+
+		UpdateLightBVHNode(leftChildIdx);
+		UpdateLightBVHNode(leftChildIdx + 1);
+
+		SubdivideLightBVH(leftChildIdx);
+		SubdivideLightBVH(leftChildIdx + 1);
 	}
+#pragma endregion
 
 #pragma region Scene Helpers
 	Sphere* Scene::AddSphere(const Vector3& origin, float radius, unsigned char materialIndex)
@@ -123,18 +777,41 @@ namespace dae {
 		TriangleMesh m{};
 		m.cullMode = cullMode;
 		m.materialIndex = materialIndex;
+		m.packetWidth = GeometryUtils::GetTrianglePacketWidth(Utils::GetSIMDLevel());
 
-		m_TriangleMeshGeometries.emplace_back(m);
+		m_TriangleMeshGeometries.emplace_back(std::move(m));
 		return &m_TriangleMeshGeometries.back();
 	}
 
-	Light* Scene::AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color)
+	TriangleMesh* Scene::AddInstancedMesh()
+	{
+		m_pInstancedMeshes.emplace_back(std::make_unique<TriangleMesh>());
+		m_pInstancedMeshes.back()->packetWidth = GeometryUtils::GetTrianglePacketWidth(Utils::GetSIMDLevel());
+
+		return m_pInstancedMeshes.back().get();
+	}
+
+	TriangleMeshInstance* Scene::AddTriangleMeshInstance(const TriangleMesh* pMesh, TriangleCullMode cullMode, unsigned char materialIndex)
+	{
+		TriangleMeshInstance instance{};
+		instance.pMesh = pMesh;
+		instance.cullMode = cullMode;
+		instance.materialIndex = materialIndex;
+		instance.UpdateTransforms();
+
+		m_TriangleMeshInstances.emplace_back(instance);
+		return &m_TriangleMeshInstances.back();
+	}
+
+	Light* Scene::AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color, float radianceCutoff)
 	{
 		Light l;
 		l.origin = origin;
 		l.intensity = intensity;
 		l.color = color;
 		l.type = LightType::Point;
+		l.influenceRadius = LightUtils::GetInfluenceRadius(l, radianceCutoff);
+		l.sceneIndex = static_cast<uint32_t>(m_Lights.size());
 
 		m_Lights.emplace_back(l);
 		return &m_Lights.back();
@@ -147,6 +824,7 @@ namespace dae {
 		l.intensity = intensity;
 		l.color = color;
 		l.type = LightType::Directional;
+		l.sceneIndex = static_cast<uint32_t>(m_Lights.size());
 
 		m_Lights.emplace_back(l);
 		return &m_Lights.back();
@@ -155,6 +833,8 @@ namespace dae {
 	unsigned char Scene::AddMaterial(Material* pMaterial)
 	{
 		m_pMaterials.push_back(pMaterial);
+		pMaterial->AddTo(m_MaterialTable);
+
 		return static_cast<unsigned char>(m_pMaterials.size() - 1);
 	}
 #pragma endregion
@@ -242,10 +922,6 @@ namespace dae {
 		AddPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);; //Right
 		AddPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);; //Left
 
-		const auto matLambertPhong1 = AddMaterial(new Material_LambertPhong(colors::Blue, 0.5f, 0.5f, 3.f));
-		const auto matLambertPhong2 = AddMaterial(new Material_LambertPhong(colors::Blue, 0.5f, 0.5f, 15.f));
-		const auto matLambertPhong3 = AddMaterial(new Material_LambertPhong(colors::Blue, 0.5f, 0.5f, 50.f));
-
 		//Spheres
 		AddSphere(Vector3{ -1.75, 1.f, 0.f }, .75f, matCT_GrayRoughMetal);
 		AddSphere(Vector3{ 0, 1.f, 0.f }, .75f, matCT_GrayMediumMetal);
@@ -290,15 +966,17 @@ namespace dae {
 		//m_Triangles.emplace_back(triangle);
 
 		//Triangle Mesh
+		//kept in world space on purpose, the other scenes use instances so this is the one that exercises refitting
 		pMesh = AddTriangleMesh(TriangleCullMode::BackFaceCulling, matLambert_White);
 
 		Utils::ParseOBJ("Resources/simple_cube.obj", pMesh->positions,pMesh->normals,pMesh->indices);
-		
 
 		pMesh->Scale({.7f, .7f, .7f});
 		pMesh->Translate({ 0.f, 1.f, 0.f });
 
+		pMesh->UpdateAABB();
 		pMesh->UpdateTransforms();
+		pMesh->BuildBVH();
 
 		//Light
 		AddPointLight(Vector3{ 0.f, 5.f, 5.f }, 50.f, ColorRGB{ 1.f, 0.61f, .45f });//backLight
@@ -311,6 +989,11 @@ namespace dae {
 
 		pMesh->RotateY(PI_DIV_2 * pTimer->GetTotal());
 		pMesh->UpdateTransforms();
+
+		//the vertices moved, refit the tree, it only gets rebuilt once the refit got too much worse
+		pMesh->UpdateBVH();
+
+		MarkDirty();
 	}
 #pragma endregion
 	void Scene_W4_ReferenceScene::Initialize()
@@ -346,33 +1029,25 @@ namespace dae {
 
 		const Triangle baseTriangle = { Vector3(-0.75f, 1.5f, 0.0f), Vector3(0.75f, 0.0f, 0.0f), Vector3(-0.75f, 0.0f, 0.0f) };
 
-		m_pMeshes[0] = AddTriangleMesh(TriangleCullMode::BackFaceCulling, matLambert_White);
-		m_pMeshes[0]->AppendTriangle(baseTriangle, true);
-		//m_pMeshes[0]->pBVHNode = new BVHNode[m_pMeshes[0]->indices.size() / 3 * 2 - 1]{};
+		//one triangle mesh shared by all three instances, only the placement and cullmode differ
+		TriangleMesh* pTriangleMesh = AddInstancedMesh();
+		pTriangleMesh->AppendTriangle(baseTriangle, true);
+		pTriangleMesh->UpdateAABB();
+		pTriangleMesh->UpdateTransforms();
+		pTriangleMesh->BuildBVH();
+
+		m_pMeshes[0] = AddTriangleMeshInstance(pTriangleMesh, TriangleCullMode::BackFaceCulling, matLambert_White);
 		m_pMeshes[0]->Translate({ -1.75f, 4.5f, 0.0f });
-		m_pMeshes[0]->UpdateAABB();
 		m_pMeshes[0]->UpdateTransforms();
 
-		//m_pMeshes[0]->BuildBVH();
-
-		m_pMeshes[1] = AddTriangleMesh(TriangleCullMode::FrontFaceCulling, matLambert_White);
-		m_pMeshes[1]->AppendTriangle(baseTriangle, true);
-		//m_pMeshes[1]->pBVHNode = new BVHNode[m_pMeshes[1]->indices.size() / 3 * 2 - 1]{};
+		m_pMeshes[1] = AddTriangleMeshInstance(pTriangleMesh, TriangleCullMode::FrontFaceCulling, matLambert_White);
 		m_pMeshes[1]->Translate({ 0.0f, 4.5f, 0.0f });
-		m_pMeshes[1]->UpdateAABB();
 		m_pMeshes[1]->UpdateTransforms();
 
-		//m_pMeshes[1]->BuildBVH();
-
-		m_pMeshes[2] = AddTriangleMesh(TriangleCullMode::NoCulling, matLambert_White);
-		m_pMeshes[2]->AppendTriangle(baseTriangle, true);
-		//m_pMeshes[2]->pBVHNode = new BVHNode[m_pMeshes[2]->indices.size() / 3 * 2 - 1]{};
+		m_pMeshes[2] = AddTriangleMeshInstance(pTriangleMesh, TriangleCullMode::NoCulling, matLambert_White);
 		m_pMeshes[2]->Translate({ 1.75f, 4.5f, 0.0f });
-		m_pMeshes[2]->UpdateAABB();
 		m_pMeshes[2]->UpdateTransforms();
 
-		//m_pMeshes[2]->BuildBVH();
-
 
 		//Light
 		AddPointLight(Vector3{ 0.0f, 5.0f, 5.0f }, 50.f, ColorRGB{ 1.0f, 0.61f, 0.45f }); // Backlight
@@ -383,15 +1058,15 @@ namespace dae {
 	{
 		Scene::Update(pTimer);
 
-		const float yawAngle{ (cos(pTimer->GetTotal()) + 1.f) / 2.f * PI_2};
+		const float yawAngle{ (cosf(pTimer->GetTotal()) + 1.f) / 2.f * PI_2 };
 
 		for (const auto m : m_pMeshes)
 		{
 			m->RotateY(yawAngle);
 			m->UpdateTransforms();
-
-			//m->BuildBVH();
 		}
+
+		MarkDirty();
 	}
 	void Scene_W4_Bunny::Initialize()
 	{
@@ -409,19 +1084,20 @@ namespace dae {
 		AddPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);; //Right
 		AddPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);; //Left
 
-		m_pMesh = AddTriangleMesh(TriangleCullMode::BackFaceCulling, matLambert_White);
+		//the BVH is built once in object space, rotating the instance only changes its matrices
+		TriangleMesh* pBunny = AddInstancedMesh();
 
-		Utils::ParseOBJ("Resources/lowpoly_bunny2.obj", m_pMesh->positions, m_pMesh->normals, m_pMesh->indices);
+		Utils::ParseOBJ("Resources/lowpoly_bunny2.obj", pBunny->positions, pBunny->normals, pBunny->indices);
 
-		m_pMesh->pBVHNode = new BVHNode[m_pMesh->indices.size()/3 * 2 -1]{};
+		pBunny->UpdateAABB();
+		pBunny->UpdateTransforms();
+		pBunny->BuildBVH();
 
-		m_pMesh->Scale({ 2.f, 2.f, 2.f });
+		m_pMesh = AddTriangleMeshInstance(pBunny, TriangleCullMode::BackFaceCulling, matLambert_White);
 
-		m_pMesh->UpdateAABB();
+		m_pMesh->Scale({ 2.f, 2.f, 2.f });
 		m_pMesh->UpdateTransforms();
 
-		m_pMesh->BuildBVH();
-
 		//Light
 		AddPointLight(Vector3{ 0.f, 5.f, 5.f }, 50.f, ColorRGB{ 1.f, 0.61f, .45f });//backLight
 		AddPointLight(Vector3{ -2.5f, 5.f, -5.f }, 70.f, ColorRGB{ 1.f, 0.8f, .45f });//front light lef
@@ -431,13 +1107,55 @@ namespace dae {
 	{
 		Scene::Update(pTimer);
 
-		const float yawAngle{ (cos(pTimer->GetTotal()) + 1.f) / 2.f * PI_2 };
+		const float yawAngle{ (cosf(pTimer->GetTotal()) + 1.f) / 2.f * PI_2 };
 
 		m_pMesh->RotateY(yawAngle);
 		m_pMesh->UpdateTransforms();
 
-		m_pMesh->BuildBVH();
+		MarkDirty();
+	}
+
+#pragma region Many Lights
+	void Scene_ManyLights::Initialize()
+	{
+		sceneName = "Many Lights Scene";
+		m_Camera.origin = { 0.f, 3.f, -9.f };
+		m_Camera.fovAngle = 45.f;
+
+		const auto matCT_GraySmoothMetal = AddMaterial(new Material_CookTorrence({ .972f, .960f, .915f }, 1.f, .1f));
+		const auto matCT_GrayRoughPlastic = AddMaterial(new Material_CookTorrence({ .75f, .75f, .75f }, 0.f, 1.f));
+		const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ .49f, .57f, .57f }, 1.f));
+
+		//Plane
+		AddPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue); //Back
+		AddPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue); //Bottom
+		AddPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue); //Top
+		AddPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue); //Right
+		AddPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue); //Left
+
+		//Spheres
+		AddSphere(Vector3{ -1.75f, 1.f, 2.f }, .75f, matCT_GraySmoothMetal);
+		AddSphere(Vector3{ 0.f, 1.f, 2.f }, .75f, matCT_GrayRoughPlastic);
+		AddSphere(Vector3{ 1.75f, 1.f, 2.f }, .75f, matCT_GraySmoothMetal);
+
+		//Lights
+		//8 x 8 just above the floor, each one reaches about 4.5 units before its radiance drops below the cutoff
+		const ColorRGB lightColors[]{ colors::Red, colors::Green, colors::Blue, colors::Yellow, colors::Cyan, colors::Magenta };
+		constexpr int lightsPerSide{ 8 };
+		constexpr float lightIntensity{ 2.f };
+		constexpr float radianceCutoff{ .1f };
+
+		for (int row{}; row < lightsPerSide; ++row)
+		{
+			for (int column{}; column < lightsPerSide; ++column)
+			{
+				const Vector3 origin{ -4.5f + column * (9.f / (lightsPerSide - 1)), .5f, -2.f + row * (11.f / (lightsPerSide - 1)) };
+
+				AddPointLight(origin, lightIntensity, lightColors[(row * lightsPerSide + column) % std::size(lightColors)], radianceCutoff);
+			}
+		}
 	}
+#pragma endregion
 }
 
 
@@ -1,16 +1,17 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <memory>
 
 #include "Math.h"
 #include "DataTypes.h"
 #include "Camera.h"
+#include "Material.h"
 
 namespace dae
 {
 	//Forward Declarations
 	class Timer;
-	class Material;
 	struct Plane;
 	struct Sphere;
 	struct Light;
@@ -34,13 +35,31 @@ namespace dae
 		}
 
 		Camera& GetCamera() { return m_Camera; }
+
+		//Set when something other than the camera changed since the renderer last cleared it
+		bool IsDirty() const { return m_IsDirty; }
+		void ClearDirty() { m_IsDirty = false; }
 		void GetClosestHit(const Ray& ray, HitRecord& closestHit) const;
-		bool DoesHit(const Ray& ray) const;
+		void GetClosestHitPacket(const RayPacket& packet, HitRecord closestHits[RayPacket::Size]) const;
+		//Shadow ray query for the lanes in laneMask, returns a bitmask of the ones with anything between ray.min and ray.max
+		//the rays don't need to be coherent, a single shadow ray is a packet with one lane
+		//occluderHints is optional, a TLAS primitive per lane that gets tested first, lanes blocked during traversal get their occluder written back
+		int OccludedPacket(const RayPacket& packet, int laneMask, uint32_t occluderHints[RayPacket::Size] = nullptr) const;
+
+		void BuildTopLevelBVH();
+		//Only rebuilds the top level BVH and the sphere groups when MarkDirty got called since the last build, static scenes keep theirs
+		void UpdateTopLevelBVH();
+
+		//Light BVH over the point lights for the many light mode, directional lights reach everything and stay out of it
+		void BuildLightBVH();
+		//Picks a point light with a probability proportional to its estimated contribution at position, random is uniform in [0, 1)
+		//returns its index in GetLights() and the probability it got picked with, -1 when there are no point lights
+		int SampleLight(const Vector3& position, float random, float& pdf) const;
 
 		const std::vector<Plane>& GetPlaneGeometries() const { return m_PlaneGeometries; }
 		const std::vector<Sphere>& GetSphereGeometries() const { return m_SphereGeometries; }
 		const std::vector<Light>& GetLights() const { return m_Lights; }
-		const std::vector<Material*> GetMaterials() const { return m_pMaterials; }
+		const MaterialTable& GetMaterials() const { return m_MaterialTable; }
 
 	protected:
 		std::string	sceneName;
@@ -48,19 +67,68 @@ namespace dae
 		std::vector<Plane> m_PlaneGeometries{};
 		std::vector<Sphere> m_SphereGeometries{};
 		std::vector<TriangleMesh> m_TriangleMeshGeometries{};
+
+		//Meshes that are only rendered through instances, kept behind a pointer so instances can hold on to them
+		std::vector<std::unique_ptr<TriangleMesh>> m_pInstancedMeshes{};
+		std::vector<TriangleMeshInstance> m_TriangleMeshInstances{};
 		std::vector<Light> m_Lights{};
 		std::vector<Material*> m_pMaterials{};
+		//what shading reads, AddMaterial keeps it in sync with m_pMaterials
+		MaterialTable m_MaterialTable{};
 		//std::vector<Triangle> m_Triangles{};
 
+		//SoA copy of m_SphereGeometries in group order, rebuilt together with the top level BVH
+		SphereSoA m_Spheres{};
+		std::vector<SphereGroup> m_SphereGroups{};
+		std::vector<size_t> m_SphereOrder{};
+
+		//Top level BVH over sphere groups, meshes and mesh instances, planes are unbounded and stay a linear list
+		std::vector<TLASNode> m_TLASNodes{};
+		std::vector<TLASPrimitive> m_TLASPrimitives{};
+
+		//leaves hold a single light, m_LightBVHOrder maps the lights of the nodes to m_Lights
+		std::vector<LightBVHNode> m_LightBVHNodes{};
+		std::vector<size_t> m_LightBVHOrder{};
+
 		Camera m_Camera{};
 
+		bool m_IsDirty{ true };
+		//separate from m_IsDirty, the renderer clears that one before it gets to the top level BVH
+		bool m_IsTopLevelBVHDirty{ true };
+
+		//Scenes that move objects or lights during Update have to call this
+		void MarkDirty() { m_IsDirty = true; m_IsTopLevelBVHDirty = true; }
+
 		Sphere* AddSphere(const Vector3& origin, float radius, unsigned char materialIndex = 0);
 		Plane* AddPlane(const Vector3& origin, const Vector3& normal, unsigned char materialIndex = 0);
 		TriangleMesh* AddTriangleMesh(TriangleCullMode cullMode, unsigned char materialIndex = 0);
+		TriangleMesh* AddInstancedMesh();
+		TriangleMeshInstance* AddTriangleMeshInstance(const TriangleMesh* pMesh, TriangleCullMode cullMode, unsigned char materialIndex = 0);
 
-		Light* AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color);
+		//radianceCutoff > 0 gives the light an influence radius, past it the light gets culled from shading and shadow rays
+		Light* AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color, float radianceCutoff = 0.f);
 		Light* AddDirectionalLight(const Vector3& direction, float intensity, const ColorRGB& color);
 		unsigned char AddMaterial(Material* pMaterial);
+
+	private:
+		void BuildSphereGroups();
+		void SubdivideSphereGroup(size_t firstSphere, size_t sphereCount);
+
+		void UpdateTLASNodeBounds(size_t nodeIdx);
+		void SubdivideTLAS(size_t nodeIdx);
+
+		void UpdateLightBVHNode(size_t nodeIdx);
+		void SubdivideLightBVH(size_t nodeIdx);
+
+		void TraceClosestHit(const Ray& ray, HitCandidate& candidate) const;
+		void TraceClosestHitPacket(const RayPacket& packet, HitCandidate candidates[RayPacket::Size]) const;
+
+		void HitTest_Planes(const Ray& ray, HitCandidate& candidate) const;
+		void FinalizeHit(const Ray& ray, const HitCandidate& candidate, HitRecord& hitRecord) const;
+
+		bool HitTest_TLASPrimitive(const TLASPrimitive& primitive, const Ray& ray, HitCandidate& candidate) const;
+		bool Occluded_TLASPrimitive(const TLASPrimitive& primitive, const Ray& ray) const;
+		void HitTest_TLASPrimitivePacket(const TLASPrimitive& primitive, const RayPacket& packet, HitCandidate candidates[RayPacket::Size], int laneMask) const;
 	};
 
 	//+++++++++++++++++++++++++++++++++++++++++
@@ -148,7 +216,7 @@ namespace dae
 		void Update(Timer* pTimer) override;
 
 	private:
-		TriangleMesh* m_pMeshes[3]{};
+		TriangleMeshInstance* m_pMeshes[3]{};
 	};
 
 	//+++++++++++++++++++++++++++++++++++++++++
@@ -168,6 +236,23 @@ namespace dae
 		void Update(Timer* pTimer) override;
 
 	private:
-		TriangleMesh* m_pMesh{ nullptr };
+		TriangleMeshInstance* m_pMesh{ nullptr };
+	};
+
+	//+++++++++++++++++++++++++++++++++++++++++
+	//Many Lights Scene
+	//a grid of dim point lights with a radiance cutoff, every tile only gets shaded by the few that reach it
+	class Scene_ManyLights final : public Scene
+	{
+	public:
+		Scene_ManyLights() = default;
+		~Scene_ManyLights() override = default;
+
+		Scene_ManyLights(const Scene_ManyLights&) = delete;
+		Scene_ManyLights(Scene_ManyLights&&) noexcept = delete;
+		Scene_ManyLights& operator=(const Scene_ManyLights&) = delete;
+		Scene_ManyLights& operator=(Scene_ManyLights&&) noexcept = delete;
+
+		void Initialize() override;
 	};
 }
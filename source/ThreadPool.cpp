@@ -0,0 +1,256 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <iostream>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace dae;
+
+namespace
+{
+	uint32_t g_SharedThreadCount{};
+	bool g_PinSharedThreads{};
+
+	//set while a thread works on a loop, loops started from in there can't wait for the pool they are part of
+	thread_local bool t_IsInsideLoop{};
+}
+
+ThreadPool::ThreadPool(uint32_t threadCount, bool pinThreads)
+	: m_PinThreads{ pinThreads }
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	if (m_PinThreads)
+	{
+		GatherHardwareThreads();
+	}
+
+	m_Workers.reserve(threadCount - 1);
+
+	for (uint32_t i{ 1 }; i < threadCount; ++i)
+	{
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard lock{ m_Mutex };
+		m_IsStopping = true;
+	}
+
+	m_JobCondition.notify_all();
+
+	for (std::thread& worker : m_Workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t begin, size_t end)>& job)
+{
+	if (count == 0) return;
+
+	grainSize = std::max(grainSize, size_t{ 1 });
+
+	const size_t chunkCount{ (count + grainSize - 1) / grainSize };
+
+	std::unique_lock loopLock{ m_LoopMutex, std::defer_lock };
+
+	//a single chunk isn't worth waking anyone for
+	if (chunkCount == 1 || m_Workers.empty() || t_IsInsideLoop || !loopLock.try_lock())
+	{
+		for (size_t begin{}; begin < count; begin += grainSize)
+		{
+			job(begin, std::min(begin + grainSize, count));
+		}
+
+		return;
+	}
+
+	{
+		std::lock_guard lock{ m_Mutex };
+
+		m_pJob = &job;
+		m_Count = count;
+		m_GrainSize = grainSize;
+		m_ChunkCount = chunkCount;
+
+		m_NextChunk.store(0, std::memory_order_relaxed);
+
+		m_BusyWorkers = static_cast<uint32_t>(m_Workers.size());
+		++m_JobIndex;
+	}
+
+	m_JobCondition.notify_all();
+
+	//the calling thread works along instead of just waiting
+	RunChunks();
+
+	std::unique_lock lock{ m_Mutex };
+	m_DoneCondition.wait(lock, [this] { return m_BusyWorkers == 0; });
+
+	m_pJob = nullptr;
+}
+
+void ThreadPool::Configure(uint32_t threadCount, bool pinThreads)
+{
+	g_SharedThreadCount = threadCount;
+	g_PinSharedThreads = pinThreads;
+}
+
+ThreadPool& ThreadPool::GetShared()
+{
+	static ThreadPool threadPool{ g_SharedThreadCount, g_PinSharedThreads };
+
+	return threadPool;
+}
+
+void ThreadPool::WorkerLoop(uint32_t workerIdx)
+{
+	if (m_PinThreads)
+	{
+#if defined(_WIN32)
+		PinThread(GetCurrentThread(), workerIdx);
+#else
+		PinThread(pthread_self(), workerIdx);
+#endif
+	}
+
+	uint64_t lastJobIndex{};
+
+	while (true)
+	{
+		{
+			std::unique_lock lock{ m_Mutex };
+			m_JobCondition.wait(lock, [this, lastJobIndex] { return m_IsStopping || m_JobIndex != lastJobIndex; });
+
+			if (m_IsStopping) return;
+
+			lastJobIndex = m_JobIndex;
+		}
+
+		RunChunks();
+
+		bool isLastWorker{};
+
+		{
+			std::lock_guard lock{ m_Mutex };
+			isLastWorker = --m_BusyWorkers == 0;
+		}
+
+		if (isLastWorker)
+		{
+			m_DoneCondition.notify_one();
+		}
+	}
+}
+
+void ThreadPool::RunChunks()
+{
+	t_IsInsideLoop = true;
+
+	while (true)
+	{
+		const size_t chunkIdx{ m_NextChunk.fetch_add(1, std::memory_order_relaxed) };
+
+		if (chunkIdx >= m_ChunkCount) break;
+
+		const size_t begin{ chunkIdx * m_GrainSize };
+
+		(*m_pJob)(begin, std::min(begin + m_GrainSize, m_Count));
+	}
+
+	t_IsInsideLoop = false;
+}
+
+//Only the hardware threads in the affinity of the process, taskset or a container can leave out any of them
+void ThreadPool::GatherHardwareThreads()
+{
+#if defined(_WIN32)
+	const WORD groupCount{ GetActiveProcessorGroupCount() };
+
+	if (groupCount <= 1)
+	{
+		DWORD_PTR processMask{};
+		DWORD_PTR systemMask{};
+
+		if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+		{
+			for (uint32_t i{}; i < sizeof(DWORD_PTR) * 8; ++i)
+			{
+				if (processMask & (DWORD_PTR{ 1 } << i)) m_HardwareThreads.push_back({ 0, i });
+			}
+		}
+	}
+	else
+	{
+		//a thread can only be pinned inside one group, so past 64 hardware threads every one gets addressed by its group
+		for (WORD group{}; group < groupCount; ++group)
+		{
+			const DWORD groupThreadCount{ GetActiveProcessorCount(group) };
+
+			for (uint32_t i{}; i < groupThreadCount; ++i)
+			{
+				m_HardwareThreads.push_back({ group, i });
+			}
+		}
+	}
+#else
+	cpu_set_t cpuSet{};
+	CPU_ZERO(&cpuSet);
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuSet) == 0)
+	{
+		for (uint32_t i{}; i < CPU_SETSIZE; ++i)
+		{
+			if (CPU_ISSET(i, &cpuSet)) m_HardwareThreads.push_back({ 0, i });
+		}
+	}
+#endif
+
+	if (m_HardwareThreads.empty())
+	{
+		std::cout << "Couldn't read the hardware threads this process may use, threads won't be pinned" << std::endl;
+		m_PinThreads = false;
+	}
+}
+
+//Wraps around when there are more threads than hardware threads
+void ThreadPool::PinThread(std::thread::native_handle_type thread, uint32_t workerIdx) const
+{
+	const HardwareThread& hardwareThread{ m_HardwareThreads[workerIdx % m_HardwareThreads.size()] };
+
+#if defined(_WIN32)
+	GROUP_AFFINITY affinity{};
+	affinity.Group = hardwareThread.group;
+	affinity.Mask = KAFFINITY{ 1 } << hardwareThread.index;
+
+	if (!SetThreadGroupAffinity(thread, &affinity, nullptr))
+	{
+		std::cout << "Couldn't pin worker " << workerIdx << " to hardware thread " << hardwareThread.index << " of group " << hardwareThread.group
+			<< ", error " << GetLastError() << std::endl;
+	}
+#else
+	cpu_set_t cpuSet{};
+	CPU_ZERO(&cpuSet);
+	CPU_SET(hardwareThread.index, &cpuSet);
+
+	if (const int error{ pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuSet) }; error != 0)
+	{
+		std::cout << "Couldn't pin worker " << workerIdx << " to hardware thread " << hardwareThread.index << ", error " << error << std::endl;
+	}
+#endif
+}
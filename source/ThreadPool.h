@@ -0,0 +1,78 @@
+#pragma once
+
+//Standard includes
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	//Worker threads that live as long as the pool and split loops between them, rendering, BVH builds and OBJ loading all share one
+	//workers sleep on a condition variable between loops and grab the next chunk of the current one from an atomic counter
+	class ThreadPool final
+	{
+	public:
+		//0 uses one thread per hardware thread, the thread calling ParallelFor counts as one of them
+		//pinThreads locks worker i to the i-th hardware thread the process is allowed to run on, the thread constructing the pool stays unpinned
+		explicit ThreadPool(uint32_t threadCount = 0, bool pinThreads = false);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool(ThreadPool&&) noexcept = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		ThreadPool& operator=(ThreadPool&&) noexcept = delete;
+
+		//Calls job for consecutive ranges [begin, end) of at most grainSize items until all count of them are done, returns when they are
+		//a loop started from inside a job, or while another thread's loop runs, goes through its chunks on the calling thread
+		void ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t begin, size_t end)>& job);
+
+		uint32_t GetThreadCount() const { return static_cast<uint32_t>(m_Workers.size()) + 1; }
+
+		//The pool everything shares, Configure only has an effect when it comes before the first GetShared
+		static void Configure(uint32_t threadCount, bool pinThreads);
+		static ThreadPool& GetShared();
+
+	private:
+		void WorkerLoop(uint32_t workerIdx);
+		void RunChunks();
+
+		//a hardware thread the process may run on, the group only matters on Windows machines with more than 64 of them
+		struct HardwareThread
+		{
+			uint16_t group{};
+			uint32_t index{};
+		};
+
+		void GatherHardwareThreads();
+		void PinThread(std::thread::native_handle_type thread, uint32_t workerIdx) const;
+
+		std::vector<std::thread> m_Workers{};
+
+		bool m_PinThreads{};
+		std::vector<HardwareThread> m_HardwareThreads{};
+
+		//one loop at a time, callers that can't get it run their loop by themselves
+		std::mutex m_LoopMutex{};
+
+		std::mutex m_Mutex{};
+		std::condition_variable m_JobCondition{};
+		std::condition_variable m_DoneCondition{};
+
+		//bumped for every loop, workers compare it against the last one they worked on
+		uint64_t m_JobIndex{};
+		uint32_t m_BusyWorkers{};
+		bool m_IsStopping{ false };
+
+		//current loop, only written while no worker is busy
+		const std::function<void(size_t, size_t)>* m_pJob{};
+		size_t m_Count{};
+		size_t m_GrainSize{};
+		size_t m_ChunkCount{};
+
+		std::atomic<size_t> m_NextChunk{};
+	};
+}
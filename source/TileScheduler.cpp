@@ -0,0 +1,31 @@
+#include "TileScheduler.h"
+
+#include <algorithm>
+
+using namespace dae;
+
+void TileScheduler::Run(int width, int height, int tileWidth, int tileHeight, const std::function<void(const Tile&)>& renderTile)
+{
+	if (width <= 0 || height <= 0) return;
+
+	tileWidth = std::max(tileWidth, 1);
+	tileHeight = std::max(tileHeight, 1);
+
+	const int tilesPerRow{ (width + tileWidth - 1) / tileWidth };
+	const int tileCount{ tilesPerRow * ((height + tileHeight - 1) / tileHeight) };
+
+	//one tile per chunk, so threads that finish early pick up the remaining ones
+	m_ThreadPool.ParallelFor(static_cast<size_t>(tileCount), 1, [&](size_t firstTile, size_t endTile)
+		{
+			for (size_t tileIdx{ firstTile }; tileIdx < endTile; ++tileIdx)
+			{
+				Tile tile{};
+				tile.minX = (static_cast<int>(tileIdx) % tilesPerRow) * tileWidth;
+				tile.minY = (static_cast<int>(tileIdx) / tilesPerRow) * tileHeight;
+				tile.maxX = std::min(tile.minX + tileWidth, width);
+				tile.maxY = std::min(tile.minY + tileHeight, height);
+
+				renderTile(tile);
+			}
+		});
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+//Standard includes
+#include <cstdint>
+#include <functional>
+
+//Project includes
+#include "ThreadPool.h"
+
+namespace dae
+{
+	//Screen space rectangle, max is exclusive
+	struct Tile
+	{
+		int minX{};
+		int minY{};
+		int maxX{};
+		int maxY{};
+	};
+
+	//Splits the framebuffer into tiles and hands them out to the threads of a ThreadPool
+	//threads grab the next tile from an atomic counter, so faster threads simply end up rendering more tiles
+	class TileScheduler final
+	{
+	public:
+		explicit TileScheduler(ThreadPool& threadPool) : m_ThreadPool{ threadPool } {}
+		~TileScheduler() = default;
+
+		TileScheduler(const TileScheduler&) = delete;
+		TileScheduler(TileScheduler&&) noexcept = delete;
+		TileScheduler& operator=(const TileScheduler&) = delete;
+		TileScheduler& operator=(TileScheduler&&) noexcept = delete;
+
+		//Calls renderTile once for every tile of a width x height image and returns when all of them are done
+		void Run(int width, int height, int tileWidth, int tileHeight, const std::function<void(const Tile&)>& renderTile);
+
+		uint32_t GetThreadCount() const { return m_ThreadPool.GetThreadCount(); }
+
+	private:
+		ThreadPool& m_ThreadPool;
+	};
+}
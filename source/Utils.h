@@ -1,10 +1,29 @@
 #pragma once
 #include <cassert>
+#include <charconv>
+#include <cstdlib>
 #include <fstream>
+#include <iterator>
+#include <string>
 #include "Math.h"
 #include "DataTypes.h"
 #include <xmmintrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
 #include <iostream>
+#include <bit>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//Marks functions with 8 wide kernels, only they get compiled for AVX2 so the rest of the build runs on any x64 CPU
+//they may only be called once GetSIMDLevel() reported AVX2, MSVC accepts the intrinsics anywhere and needs nothing
+#if defined(_MSC_VER) && !defined(__clang__)
+#define DAE_TARGET_AVX2
+#else
+#define DAE_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
 
 namespace dae
 {
@@ -16,12 +35,123 @@ namespace dae
 		{
 			return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ps1(arg)));
 		}
+
+		enum class SIMDLevel
+		{
+			Scalar,
+			SSE,
+			AVX2
+		};
+
+		inline SIMDLevel DetectSIMDLevel()
+		{
+#ifdef _MSC_VER
+			int info[4]{};
+
+			__cpuid(info, 0);
+			const int highestLeaf{ info[0] };
+
+			__cpuid(info, 1);
+			const bool hasSSE2{ (info[3] & (1 << 26)) != 0 };
+			const bool hasAVX{ (info[2] & (1 << 28)) != 0 };
+			const bool hasOSXSave{ (info[2] & (1 << 27)) != 0 };
+			const bool hasFMA{ (info[2] & (1 << 12)) != 0 };
+
+			if (!hasSSE2) return SIMDLevel::Scalar;
+
+			if (!hasAVX || !hasOSXSave || highestLeaf < 7) return SIMDLevel::SSE;
+
+			//the OS has to save the upper halves of the ymm registers on context switches
+			if ((_xgetbv(0) & 0x6) != 0x6) return SIMDLevel::SSE;
+
+			__cpuidex(info, 7, 0);
+			const bool hasAVX2{ (info[1] & (1 << 5)) != 0 };
+
+			return hasAVX2 && hasFMA ? SIMDLevel::AVX2 : SIMDLevel::SSE;
+#else
+			//this can run during static initialization, before the runtime filled in the cpu model
+			__builtin_cpu_init();
+
+			if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMDLevel::AVX2;
+			if (__builtin_cpu_supports("sse2")) return SIMDLevel::SSE;
+
+			return SIMDLevel::Scalar;
+#endif
+		}
+
+		//Detected once, the first time any kernel asks for it
+		inline SIMDLevel GetSIMDLevel()
+		{
+			static const SIMDLevel simdLevel{ DetectSIMDLevel() };
+			return simdLevel;
+		}
+
+		//PCG hash, scrambles pixel and frame indices into seeds for RandomFloat
+		inline uint32_t HashPCG(uint32_t value)
+		{
+			const uint32_t state{ value * 747796405u + 2891336453u };
+			const uint32_t word{ ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u };
+
+			return (word >> 22u) ^ word;
+		}
+
+		//Uniform float in [0, 1), advances state
+		inline float RandomFloat(uint32_t& state)
+		{
+			state = HashPCG(state);
+
+			return (state >> 8) * (1.f / 16777216.f);
+		}
 	}
 
 	namespace GeometryUtils
 	{
+		//Closest hit queries look for the nearest hit in front of the current one, occlusion queries stop at the first hit between min and max
+		enum class RayQuery
+		{
+			ClosestHit,
+			Occlusion
+		};
+
+		//Returns the lane of the closest of the lanes in laneMask
+		inline int GetClosestLane(int laneMask, const float* t)
+		{
+			int closestLane{ std::countr_zero(static_cast<unsigned int>(laneMask)) };
+			laneMask &= laneMask - 1;
+
+			while (laneMask != 0)
+			{
+				const int lane{ std::countr_zero(static_cast<unsigned int>(laneMask)) };
+				laneMask &= laneMask - 1;
+
+				if (t[lane] < t[closestLane]) closestLane = lane;
+			}
+
+			return closestLane;
+		}
+
 #pragma region Sphere HitTest
 		//SPHERE HIT-TESTS
+		//Only computes t, the HitRecord version and the batched tests build on it
+		inline bool HitTest_Sphere(const Vector3& origin, float radiusSquared, const Ray& ray, float& t)
+		{
+			const Vector3 ToCenter { origin - ray.origin };
+
+			const float ray2PointLength { Vector3::Dot(ToCenter, ray.direction) };
+
+			const float center2PointSquared { ToCenter.SqrMagnitude() - Square(ray2PointLength) };
+
+			const float pointToHitPointSquared { radiusSquared - center2PointSquared };
+
+			if (pointToHitPointSquared < 0) return false;
+
+			const float pointToHitPoint{ Utils::FastSqrt(pointToHitPointSquared) };
+
+			t = ray2PointLength - pointToHitPoint;
+
+			return t >= ray.min && t <= ray.max;
+		}
+
 		inline bool HitTest_Sphere(const Sphere& sphere, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
 		{
 
@@ -88,21 +218,9 @@ namespace dae
 
 #pragma endregion
 
-			const Vector3 ToCenter { sphere.origin - ray.origin };
-
-			const float ray2PointLength { Vector3::Dot(ToCenter, ray.direction) };
-
-			const float center2PointSquared { ToCenter.SqrMagnitude() - Square(ray2PointLength) };
-
-			const float pointToHitPointSquared { Square(sphere.radius) - center2PointSquared };
-
-			if (pointToHitPointSquared < 0) return false;
-
-			const float pointToHitPoint{ Utils::FastSqrt(pointToHitPointSquared) };
-
-			const float t { ray2PointLength - pointToHitPoint };
+			float t{};
 
-			if (t < ray.min || t > ray.max) return false;
+			if (!HitTest_Sphere(sphere.origin, Square(sphere.radius), ray, t)) return false;
 
 			if (!ignoreHitRecord)
 			{
@@ -197,16 +315,201 @@ namespace dae
 			HitRecord temp{};
 			return HitTest_Sphere(sphere, ray, temp, true);
 		}
+
+		//Same test as HitTest_Sphere for up to 4 consecutive spheres of a SphereSoA, only t is computed
+		//returns the lane of the closest hit in front of closestT, -1 if none of them got hit
+		template<RayQuery Query = RayQuery::ClosestHit>
+		inline int HitTest_Sphere4(const SphereSoA& spheres, size_t firstSphere, size_t sphereCount, const Ray& ray, float closestT, float& tHit)
+		{
+			const __m128 toCenterX{ _mm_sub_ps(_mm_loadu_ps(spheres.originX.Data() + firstSphere), _mm_set1_ps(ray.origin.x)) };
+			const __m128 toCenterY{ _mm_sub_ps(_mm_loadu_ps(spheres.originY.Data() + firstSphere), _mm_set1_ps(ray.origin.y)) };
+			const __m128 toCenterZ{ _mm_sub_ps(_mm_loadu_ps(spheres.originZ.Data() + firstSphere), _mm_set1_ps(ray.origin.z)) };
+
+			const __m128 ray2PointLength{ _mm_add_ps(_mm_add_ps(_mm_mul_ps(toCenterX, _mm_set1_ps(ray.direction.x)), _mm_mul_ps(toCenterY, _mm_set1_ps(ray.direction.y))), _mm_mul_ps(toCenterZ, _mm_set1_ps(ray.direction.z))) };
+
+			const __m128 toCenterSquared{ _mm_add_ps(_mm_add_ps(_mm_mul_ps(toCenterX, toCenterX), _mm_mul_ps(toCenterY, toCenterY)), _mm_mul_ps(toCenterZ, toCenterZ)) };
+			const __m128 center2PointSquared{ _mm_sub_ps(toCenterSquared, _mm_mul_ps(ray2PointLength, ray2PointLength)) };
+
+			const __m128 pointToHitPointSquared{ _mm_sub_ps(_mm_loadu_ps(spheres.radiusSquared.Data() + firstSphere), center2PointSquared) };
+
+			__m128 valid{ _mm_cmpge_ps(pointToHitPointSquared, _mm_setzero_ps()) };
+
+			//lanes past the end of the range read the padding of the buffers
+			valid = _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(static_cast<int>(sphereCount)), _mm_setr_epi32(0, 1, 2, 3))));
+
+			if (_mm_movemask_ps(valid) == 0) return -1;
+
+			const __m128 t{ _mm_sub_ps(ray2PointLength, _mm_sqrt_ps(pointToHitPointSquared)) };
+
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(ray.min)), _mm_cmple_ps(t, _mm_set1_ps(ray.max))));
+			if constexpr (Query == RayQuery::ClosestHit)
+			{
+				valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(closestT)));
+			}
+
+			const int hitMask{ _mm_movemask_ps(valid) };
+
+			if (hitMask == 0) return -1;
+
+			//any lane will do for occlusion, there is no need to sort them out
+			if constexpr (Query == RayQuery::Occlusion) return std::countr_zero(static_cast<unsigned int>(hitMask));
+
+			alignas(16) float laneT[4];
+			_mm_store_ps(laneT, t);
+
+			const int closestLane{ GetClosestLane(hitMask, laneT) };
+			tHit = laneT[closestLane];
+
+			return closestLane;
+		}
+
+		//8 wide version of HitTest_Sphere4, only call it when GetSIMDLevel() reports AVX2
+		template<RayQuery Query = RayQuery::ClosestHit>
+		DAE_TARGET_AVX2 inline int HitTest_Sphere8(const SphereSoA& spheres, size_t firstSphere, size_t sphereCount, const Ray& ray, float closestT, float& tHit)
+		{
+			const __m256 toCenterX{ _mm256_sub_ps(_mm256_loadu_ps(spheres.originX.Data() + firstSphere), _mm256_set1_ps(ray.origin.x)) };
+			const __m256 toCenterY{ _mm256_sub_ps(_mm256_loadu_ps(spheres.originY.Data() + firstSphere), _mm256_set1_ps(ray.origin.y)) };
+			const __m256 toCenterZ{ _mm256_sub_ps(_mm256_loadu_ps(spheres.originZ.Data() + firstSphere), _mm256_set1_ps(ray.origin.z)) };
+
+			const __m256 ray2PointLength{ _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(toCenterX, _mm256_set1_ps(ray.direction.x)), _mm256_mul_ps(toCenterY, _mm256_set1_ps(ray.direction.y))), _mm256_mul_ps(toCenterZ, _mm256_set1_ps(ray.direction.z))) };
+
+			const __m256 toCenterSquared{ _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(toCenterX, toCenterX), _mm256_mul_ps(toCenterY, toCenterY)), _mm256_mul_ps(toCenterZ, toCenterZ)) };
+			const __m256 center2PointSquared{ _mm256_sub_ps(toCenterSquared, _mm256_mul_ps(ray2PointLength, ray2PointLength)) };
+
+			const __m256 pointToHitPointSquared{ _mm256_sub_ps(_mm256_loadu_ps(spheres.radiusSquared.Data() + firstSphere), center2PointSquared) };
+
+			__m256 valid{ _mm256_cmp_ps(pointToHitPointSquared, _mm256_setzero_ps(), _CMP_GE_OQ) };
+
+			valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(sphereCount)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))));
+
+			if (_mm256_movemask_ps(valid) == 0) return -1;
+
+			const __m256 t{ _mm256_sub_ps(ray2PointLength, _mm256_sqrt_ps(pointToHitPointSquared)) };
+
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(ray.min), _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(ray.max), _CMP_LE_OQ)));
+			if constexpr (Query == RayQuery::ClosestHit)
+			{
+				valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(closestT), _CMP_LT_OQ));
+			}
+
+			const int hitMask{ _mm256_movemask_ps(valid) };
+
+			if (hitMask == 0) return -1;
+
+			if constexpr (Query == RayQuery::Occlusion) return std::countr_zero(static_cast<unsigned int>(hitMask));
+
+			alignas(32) float laneT[8];
+			_mm256_store_ps(laneT, t);
+
+			const int closestLane{ GetClosestLane(hitMask, laneT) };
+			tHit = laneT[closestLane];
+
+			return closestLane;
+		}
+
+		//Tests a contiguous range of spheres with the widest kernel the CPU supports
+		//candidate only gets replaced by hits in front of it
+		inline bool HitTest_Spheres(const SphereSoA& spheres, size_t firstSphere, size_t sphereCount, const Ray& ray, HitCandidate& candidate)
+		{
+			const Utils::SIMDLevel simdLevel{ Utils::GetSIMDLevel() };
+
+			float closestT{ candidate.t };
+			size_t closestSphere{ SIZE_MAX };
+
+			if (simdLevel == Utils::SIMDLevel::Scalar)
+			{
+				for (size_t sphereIdx{ firstSphere }; sphereIdx < firstSphere + sphereCount; ++sphereIdx)
+				{
+					float t{};
+
+					if (HitTest_Sphere(spheres.GetOrigin(sphereIdx), spheres.radiusSquared[sphereIdx], ray, t) && t < closestT)
+					{
+						closestT = t;
+						closestSphere = sphereIdx;
+					}
+				}
+			}
+			else
+			{
+				const size_t width{ simdLevel == Utils::SIMDLevel::AVX2 ? SphereSoA::maxSIMDWidth : 4 };
+
+				for (size_t packetStart{ firstSphere }; packetStart < firstSphere + sphereCount; packetStart += width)
+				{
+					const size_t packetCount{ std::min(width, firstSphere + sphereCount - packetStart) };
+
+					float tHit{};
+					const int lane{ width == 4
+						? HitTest_Sphere4(spheres, packetStart, packetCount, ray, closestT, tHit)
+						: HitTest_Sphere8(spheres, packetStart, packetCount, ray, closestT, tHit) };
+
+					if (lane < 0) continue;
+
+					closestT = tHit;
+					closestSphere = packetStart + lane;
+				}
+			}
+
+			if (closestSphere == SIZE_MAX) return false;
+
+			candidate = {};
+			candidate.t = closestT;
+			candidate.primitiveIdx = static_cast<uint32_t>(closestSphere);
+			candidate.type = HitPrimitiveType::Sphere;
+			candidate.materialIndex = spheres.materialIndex[closestSphere];
+
+			return true;
+		}
+
+		//Occlusion version of HitTest_Spheres, returns on the first sphere between ray.min and ray.max
+		inline bool Occluded_Spheres(const SphereSoA& spheres, size_t firstSphere, size_t sphereCount, const Ray& ray)
+		{
+			const Utils::SIMDLevel simdLevel{ Utils::GetSIMDLevel() };
+
+			if (simdLevel == Utils::SIMDLevel::Scalar)
+			{
+				for (size_t sphereIdx{ firstSphere }; sphereIdx < firstSphere + sphereCount; ++sphereIdx)
+				{
+					float t{};
+
+					if (HitTest_Sphere(spheres.GetOrigin(sphereIdx), spheres.radiusSquared[sphereIdx], ray, t)) return true;
+				}
+
+				return false;
+			}
+
+			const size_t width{ simdLevel == Utils::SIMDLevel::AVX2 ? SphereSoA::maxSIMDWidth : 4 };
+
+			for (size_t packetStart{ firstSphere }; packetStart < firstSphere + sphereCount; packetStart += width)
+			{
+				const size_t packetCount{ std::min(width, firstSphere + sphereCount - packetStart) };
+
+				float tHit{};
+				const int lane{ width == 4
+					? HitTest_Sphere4<RayQuery::Occlusion>(spheres, packetStart, packetCount, ray, ray.max, tHit)
+					: HitTest_Sphere8<RayQuery::Occlusion>(spheres, packetStart, packetCount, ray, ray.max, tHit) };
+
+				if (lane >= 0) return true;
+			}
+
+			return false;
+		}
 #pragma endregion
 
 #pragma region Plane HitTest
 		//PLANE HIT-TESTS
+		inline bool HitTest_Plane(const Plane& plane, const Ray& ray, float& t)
+		{
+			t = (Vector3::Dot(plane.origin - ray.origin, plane.normal)) / (Vector3::Dot(ray.direction, plane.normal));
+
+			return t >= ray.min && t <= ray.max;
+		}
+
 		inline bool HitTest_Plane(const Plane& plane, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
 		{
 
-			const float t = { (Vector3::Dot(plane.origin - ray.origin, plane.normal)) / (Vector3::Dot(ray.direction, plane.normal)) };
+			float t{};
 
-			if (t < ray.min || t > ray.max)
+			if (!HitTest_Plane(plane, ray, t))
 			{
 				return false;
 			}
@@ -225,27 +528,25 @@ namespace dae
 
 		inline bool HitTest_Plane(const Plane& plane, const Ray& ray)
 		{
-			HitRecord temp{};
-			return HitTest_Plane(plane, ray, temp, true);
+			float t{};
+			return HitTest_Plane(plane, ray, t);
 		}
 #pragma endregion
 #pragma region Triangle HitTest
 		//TRIANGLE HIT-TESTS
-		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		//neighbouring triangles test their shared edge from different corners, without some slack rays that land exactly on it
+		//can slip through the crack rounding leaves between them
+		constexpr float TriangleEdgeTolerance{ 1e-6f };
+
+		//Takes the edges instead of v1 and v2 so precomputed triangles can skip the setup, only computes t and the barycentrics
+		//cullMode has to be the one of the query already, see GetRayCullMode
+		inline bool HitTest_Triangle(const Vector3& v0, const Vector3& edge1, const Vector3& edge2, const Vector3& normal, TriangleCullMode cullMode, const Ray& ray, float& t, float& u, float& v)
 		{
 
-			const float dotNV{ Vector3::Dot(triangle.normal, ray.direction) };
+			const float dotNV{ Vector3::Dot(normal, ray.direction) };
 
 			if (dotNV == 0) { return false; }
 
-			TriangleCullMode cullMode{ triangle.cullMode };
-
-			if (ignoreHitRecord)
-			{
-				if (cullMode == TriangleCullMode::BackFaceCulling) { cullMode = TriangleCullMode::FrontFaceCulling; }
-				else if (cullMode == TriangleCullMode::FrontFaceCulling) { cullMode = TriangleCullMode::BackFaceCulling; }
-			}
-
 			switch (cullMode)
 			{
 			case TriangleCullMode::FrontFaceCulling:
@@ -297,10 +598,7 @@ namespace dae
 
 #pragma endregion
 
-			const float EPSILON{ 0.001f };
-
-			const Vector3 edge1{ triangle.v1 - triangle.v0 };
-			const Vector3 edge2{ triangle.v2 - triangle.v0 };
+			const float EPSILON{ 1e-7f };
 
 			const Vector3 h { Vector3::Cross(ray.direction, edge2) };
 
@@ -310,22 +608,46 @@ namespace dae
 
 			const float f { 1 / D };
 
-			const Vector3 s { ray.origin - triangle.v0 };
+			const Vector3 s { ray.origin - v0 };
 
-			const float u { f * Vector3::Dot(s, h) };
+			u = f * Vector3::Dot(s, h);
 
-			if (u < 0 || u > 1) return false;
+			if (u < -TriangleEdgeTolerance || u > 1 + TriangleEdgeTolerance) return false;
 
 			const Vector3 q { Vector3::Cross(s, edge1) };
 
-			const float v { f * Vector3::Dot(ray.direction, q) };
+			v = f * Vector3::Dot(ray.direction, q);
 
-			if (v < 0 || u + v > 1) return false;
+			if (v < -TriangleEdgeTolerance || u + v > 1 + TriangleEdgeTolerance) return false;
 
-			const float t { f * Vector3::Dot(edge2,q) };
+			t = f * Vector3::Dot(edge2,q);
 
 			if (t < ray.min || t > ray.max) return false;
 
+			return true;
+
+		}
+
+		//Shadow rays look at the triangle from the other side, so occlusion queries cull the opposite face
+		template<RayQuery Query>
+		inline TriangleCullMode GetRayCullMode(TriangleCullMode cullMode)
+		{
+			if constexpr (Query == RayQuery::ClosestHit) return cullMode;
+
+			if (cullMode == TriangleCullMode::BackFaceCulling) return TriangleCullMode::FrontFaceCulling;
+			if (cullMode == TriangleCullMode::FrontFaceCulling) return TriangleCullMode::BackFaceCulling;
+
+			return cullMode;
+		}
+
+		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			const TriangleCullMode cullMode{ ignoreHitRecord ? GetRayCullMode<RayQuery::Occlusion>(triangle.cullMode) : triangle.cullMode };
+
+			float t{}, u{}, v{};
+
+			if (!HitTest_Triangle(triangle.v0, triangle.v1 - triangle.v0, triangle.v2 - triangle.v0, triangle.normal, cullMode, ray, t, u, v)) return false;
+
 			if (!ignoreHitRecord)
 			{
 				hitRecord.didHit = true;
@@ -336,150 +658,828 @@ namespace dae
 			}
 
 			return true;
-
 		}
 
-		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray)
+		//Moller-Trumbore against up to 4 consecutive triangles of a TriangleSoA at once
+		//returns the lane of the closest hit in front of closestT, -1 if none of them got hit
+		//occlusion queries ignore closestT and the outputs, they return any lane that got hit
+		template<RayQuery Query = RayQuery::ClosestHit>
+		inline int HitTest_Triangle4(const TriangleSoA& triangles, size_t firstTriangle, size_t triangleCount, TriangleCullMode cullMode, const Ray& ray, float closestT, float& tHit, float& uHit, float& vHit)
 		{
-			HitRecord temp{};
-			return HitTest_Triangle(triangle, ray, temp, true);
-		}
-#pragma endregion
-#pragma region TriangeMesh HitTest
+			const __m128 zero{ _mm_setzero_ps() };
+			const __m128 one{ _mm_set1_ps(1.f) };
+			const __m128 minBarycentric{ _mm_set1_ps(-TriangleEdgeTolerance) };
+			const __m128 maxBarycentric{ _mm_set1_ps(1.f + TriangleEdgeTolerance) };
 
-		inline bool SlabTest_TriangleMesh(const Ray& ray, const Vector3& minAABB, const Vector3& maxAABB)
-		{
+			const __m128 dirX{ _mm_set1_ps(ray.direction.x) };
+			const __m128 dirY{ _mm_set1_ps(ray.direction.y) };
+			const __m128 dirZ{ _mm_set1_ps(ray.direction.z) };
 
-			const float tx1 {(minAABB.x - ray.origin.x) * ray.inverseDirection.x};
-			const float tx2 {(maxAABB.x - ray.origin.x) * ray.inverseDirection.x};
+			const __m128 normalX{ _mm_loadu_ps(triangles.normalX.Data() + firstTriangle) };
+			const __m128 normalY{ _mm_loadu_ps(triangles.normalY.Data() + firstTriangle) };
+			const __m128 normalZ{ _mm_loadu_ps(triangles.normalZ.Data() + firstTriangle) };
 
-			float tmin = std::min(tx1, tx2);
-			float tmax = std::max(tx1, tx2);
+			const __m128 dotNV{ _mm_add_ps(_mm_add_ps(_mm_mul_ps(normalX, dirX), _mm_mul_ps(normalY, dirY)), _mm_mul_ps(normalZ, dirZ)) };
 
-			const float ty1 {(minAABB.y - ray.origin.y) * ray.inverseDirection.y};
-			const float ty2 {(maxAABB.y - ray.origin.y) * ray.inverseDirection.y};
+			__m128 valid{};
 
-			tmin = std::max(tmin, std::min(ty1, ty2));
-			tmax = std::min(tmax, std::max(ty1, ty2));
+			switch (cullMode)
+			{
+			case TriangleCullMode::FrontFaceCulling:
+				valid = _mm_cmpgt_ps(dotNV, zero);
+				break;
+			case TriangleCullMode::BackFaceCulling:
+				valid = _mm_cmplt_ps(dotNV, zero);
+				break;
+			default:
+				valid = _mm_cmpneq_ps(dotNV, zero);
+				break;
+			}
 
-			const float tz1 {(minAABB.z - ray.origin.z) * ray.inverseDirection.z};
-			const float tz2 {(maxAABB.z - ray.origin.z) * ray.inverseDirection.z};
+			//lanes past the end of the range read the padding of the buffers
+			valid = _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(static_cast<int>(triangleCount)), _mm_setr_epi32(0, 1, 2, 3))));
 
-			tmin = std::max(tmin, std::min(tz1, tz2));
-			tmax = std::min(tmax, std::max(tz1, tz2));
+			if (_mm_movemask_ps(valid) == 0) return -1;
 
-			return tmax > 0 && tmax >= tmin;
+			const __m128 edge1X{ _mm_loadu_ps(triangles.edge1X.Data() + firstTriangle) };
+			const __m128 edge1Y{ _mm_loadu_ps(triangles.edge1Y.Data() + firstTriangle) };
+			const __m128 edge1Z{ _mm_loadu_ps(triangles.edge1Z.Data() + firstTriangle) };
 
-		}
+			const __m128 edge2X{ _mm_loadu_ps(triangles.edge2X.Data() + firstTriangle) };
+			const __m128 edge2Y{ _mm_loadu_ps(triangles.edge2Y.Data() + firstTriangle) };
+			const __m128 edge2Z{ _mm_loadu_ps(triangles.edge2Z.Data() + firstTriangle) };
 
-		inline void IntersectBVH(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, HitRecord& tempHit, bool& hasHit, size_t nodeIdx, bool ignoreHitRecord)
-		{
-			const BVHNode& node{ mesh.pBVHNode[nodeIdx] };
+			//h = direction x edge2
+			const __m128 hX{ _mm_sub_ps(_mm_mul_ps(dirY, edge2Z), _mm_mul_ps(dirZ, edge2Y)) };
+			const __m128 hY{ _mm_sub_ps(_mm_mul_ps(dirZ, edge2X), _mm_mul_ps(dirX, edge2Z)) };
+			const __m128 hZ{ _mm_sub_ps(_mm_mul_ps(dirX, edge2Y), _mm_mul_ps(dirY, edge2X)) };
 
-			if (!SlabTest_TriangleMesh(ray, node.minAABB, node.maxAABB)) return;
+			const __m128 D{ _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, hX), _mm_mul_ps(edge1Y, hY)), _mm_mul_ps(edge1Z, hZ)) };
 
-			if (node.IsLeaf())
-			{
-				Triangle tempTriangle{};
-				tempTriangle.cullMode = mesh.cullMode;
-				tempTriangle.materialIndex = mesh.materialIndex;
+			valid = _mm_and_ps(valid, _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), D), _mm_set1_ps(1e-7f)));
 
-				for (uint32_t currTriangleIdx{}; currTriangleIdx < node.IndiceCount; currTriangleIdx += 3)
-				{
+			const __m128 f{ _mm_div_ps(one, D) };
 
-					const size_t indicePlusCurrIdx{ node.firstIndice + currTriangleIdx };
+			const __m128 sX{ _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(triangles.v0X.Data() + firstTriangle)) };
+			const __m128 sY{ _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(triangles.v0Y.Data() + firstTriangle)) };
+			const __m128 sZ{ _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(triangles.v0Z.Data() + firstTriangle)) };
 
-					tempTriangle.normal = mesh.transformedNormals[indicePlusCurrIdx /3];
+			const __m128 u{ _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sX, hX), _mm_mul_ps(sY, hY)), _mm_mul_ps(sZ, hZ))) };
 
-					tempTriangle.v0 = mesh.transformedPositions[mesh.indices[indicePlusCurrIdx]];
-					tempTriangle.v1 = mesh.transformedPositions[mesh.indices[indicePlusCurrIdx + 1]];
-					tempTriangle.v2 = mesh.transformedPositions[mesh.indices[indicePlusCurrIdx + 2]];
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, minBarycentric), _mm_cmple_ps(u, maxBarycentric)));
 
-					if (HitTest_Triangle(tempTriangle, ray, tempHit, ignoreHitRecord))
-					{
-						hasHit = true;
+			//q = s x edge1
+			const __m128 qX{ _mm_sub_ps(_mm_mul_ps(sY, edge1Z), _mm_mul_ps(sZ, edge1Y)) };
+			const __m128 qY{ _mm_sub_ps(_mm_mul_ps(sZ, edge1X), _mm_mul_ps(sX, edge1Z)) };
+			const __m128 qZ{ _mm_sub_ps(_mm_mul_ps(sX, edge1Y), _mm_mul_ps(sY, edge1X)) };
 
-						if (ignoreHitRecord)
-						{
-							return;
-						}
+			const __m128 v{ _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dirX, qX), _mm_mul_ps(dirY, qY)), _mm_mul_ps(dirZ, qZ))) };
 
-						if (tempHit.t < hitRecord.t)
-						{
-							hitRecord = tempHit; 
-						}
-					}
-				}
-			}
-			else
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, minBarycentric), _mm_cmple_ps(_mm_add_ps(u, v), maxBarycentric)));
+
+			const __m128 t{ _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ))) };
+
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(ray.min)), _mm_cmple_ps(t, _mm_set1_ps(ray.max))));
+			if constexpr (Query == RayQuery::ClosestHit)
 			{
-				IntersectBVH(mesh, ray, hitRecord, tempHit, hasHit, node.leftNode, ignoreHitRecord);
-				IntersectBVH(mesh, ray, hitRecord, tempHit, hasHit, node.leftNode + 1, ignoreHitRecord);
+				valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(closestT)));
 			}
+
+			const int hitMask{ _mm_movemask_ps(valid) };
+
+			if (hitMask == 0) return -1;
+
+			//any lane will do for occlusion, there is no need to sort them out
+			if constexpr (Query == RayQuery::Occlusion) return std::countr_zero(static_cast<unsigned int>(hitMask));
+
+			alignas(16) float laneT[4];
+			alignas(16) float laneU[4];
+			alignas(16) float laneV[4];
+			_mm_store_ps(laneT, t);
+			_mm_store_ps(laneU, u);
+			_mm_store_ps(laneV, v);
+
+			const int closestLane{ GetClosestLane(hitMask, laneT) };
+			tHit = laneT[closestLane];
+			uHit = laneU[closestLane];
+			vHit = laneV[closestLane];
+
+			return closestLane;
 		}
 
-		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		//8 wide version of HitTest_Triangle4, only call it when GetSIMDLevel() reports AVX2
+		template<RayQuery Query = RayQuery::ClosestHit>
+		DAE_TARGET_AVX2 inline int HitTest_Triangle8(const TriangleSoA& triangles, size_t firstTriangle, size_t triangleCount, TriangleCullMode cullMode, const Ray& ray, float closestT, float& tHit, float& uHit, float& vHit)
 		{
-//#define BVH
+			const __m256 zero{ _mm256_setzero_ps() };
+			const __m256 one{ _mm256_set1_ps(1.f) };
+			const __m256 minBarycentric{ _mm256_set1_ps(-TriangleEdgeTolerance) };
+			const __m256 maxBarycentric{ _mm256_set1_ps(1.f + TriangleEdgeTolerance) };
 
-			HitRecord tempHit{};
+			const __m256 dirX{ _mm256_set1_ps(ray.direction.x) };
+			const __m256 dirY{ _mm256_set1_ps(ray.direction.y) };
+			const __m256 dirZ{ _mm256_set1_ps(ray.direction.z) };
 
-			bool hasHit{ false };
+			const __m256 normalX{ _mm256_loadu_ps(triangles.normalX.Data() + firstTriangle) };
+			const __m256 normalY{ _mm256_loadu_ps(triangles.normalY.Data() + firstTriangle) };
+			const __m256 normalZ{ _mm256_loadu_ps(triangles.normalZ.Data() + firstTriangle) };
 
-#ifndef BVH
-			if (!SlabTest_TriangleMesh(ray, mesh.transformedMinAABB, mesh.transformedMaxAABB))
-			{ 
-				return false; 
+			const __m256 dotNV{ _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(normalX, dirX), _mm256_mul_ps(normalY, dirY)), _mm256_mul_ps(normalZ, dirZ)) };
+
+			__m256 valid{};
+
+			switch (cullMode)
+			{
+			case TriangleCullMode::FrontFaceCulling:
+				valid = _mm256_cmp_ps(dotNV, zero, _CMP_GT_OQ);
+				break;
+			case TriangleCullMode::BackFaceCulling:
+				valid = _mm256_cmp_ps(dotNV, zero, _CMP_LT_OQ);
+				break;
+			default:
+				valid = _mm256_cmp_ps(dotNV, zero, _CMP_NEQ_OQ);
+				break;
 			}
 
-			Triangle tempTriangle{};
+			valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(triangleCount)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))));
 
-			tempTriangle.cullMode = mesh.cullMode;
-			tempTriangle.materialIndex = mesh.materialIndex;
+			if (_mm256_movemask_ps(valid) == 0) return -1;
 
-			for (int i{}; i < mesh.indices.size(); i += 3)
-			{
-				tempTriangle.normal = mesh.transformedNormals[i / 3];
+			const __m256 edge1X{ _mm256_loadu_ps(triangles.edge1X.Data() + firstTriangle) };
+			const __m256 edge1Y{ _mm256_loadu_ps(triangles.edge1Y.Data() + firstTriangle) };
+			const __m256 edge1Z{ _mm256_loadu_ps(triangles.edge1Z.Data() + firstTriangle) };
 
-				tempTriangle.v0 = mesh.transformedPositions[mesh.indices[i]];
-				tempTriangle.v1 = mesh.transformedPositions[mesh.indices[i + 1]];
-				tempTriangle.v2 = mesh.transformedPositions[mesh.indices[i + 2]];
+			const __m256 edge2X{ _mm256_loadu_ps(triangles.edge2X.Data() + firstTriangle) };
+			const __m256 edge2Y{ _mm256_loadu_ps(triangles.edge2Y.Data() + firstTriangle) };
+			const __m256 edge2Z{ _mm256_loadu_ps(triangles.edge2Z.Data() + firstTriangle) };
 
-				if (HitTest_Triangle(tempTriangle, ray, tempHit, ignoreHitRecord))
-				{
-					hasHit = true;
+			const __m256 hX{ _mm256_sub_ps(_mm256_mul_ps(dirY, edge2Z), _mm256_mul_ps(dirZ, edge2Y)) };
+			const __m256 hY{ _mm256_sub_ps(_mm256_mul_ps(dirZ, edge2X), _mm256_mul_ps(dirX, edge2Z)) };
+			const __m256 hZ{ _mm256_sub_ps(_mm256_mul_ps(dirX, edge2Y), _mm256_mul_ps(dirY, edge2X)) };
 
-					if (ignoreHitRecord)
-					{
-						return true;
-					}
+			const __m256 D{ _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge1X, hX), _mm256_mul_ps(edge1Y, hY)), _mm256_mul_ps(edge1Z, hZ)) };
 
-					if (tempHit.t < hitRecord.t)
-					{
-						hitRecord = tempHit;
-					}
-				}
-			}
-#endif
+			valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.f), D), _mm256_set1_ps(1e-7f), _CMP_GE_OQ));
 
-#ifdef BVH
+			const __m256 f{ _mm256_div_ps(one, D) };
 
-			IntersectBVH(mesh, ray, hitRecord, tempHit, hasHit, mesh.pBVHNode->firstIndice, ignoreHitRecord);
+			const __m256 sX{ _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(triangles.v0X.Data() + firstTriangle)) };
+			const __m256 sY{ _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(triangles.v0Y.Data() + firstTriangle)) };
+			const __m256 sZ{ _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(triangles.v0Z.Data() + firstTriangle)) };
 
-#endif
+			const __m256 u{ _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sX, hX), _mm256_mul_ps(sY, hY)), _mm256_mul_ps(sZ, hZ))) };
 
-			return hasHit;
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, minBarycentric, _CMP_GE_OQ), _mm256_cmp_ps(u, maxBarycentric, _CMP_LE_OQ)));
 
-		}
+			const __m256 qX{ _mm256_sub_ps(_mm256_mul_ps(sY, edge1Z), _mm256_mul_ps(sZ, edge1Y)) };
+			const __m256 qY{ _mm256_sub_ps(_mm256_mul_ps(sZ, edge1X), _mm256_mul_ps(sX, edge1Z)) };
+			const __m256 qZ{ _mm256_sub_ps(_mm256_mul_ps(sX, edge1Y), _mm256_mul_ps(sY, edge1X)) };
 
-		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
-		{
-			HitRecord temp{};
-			return HitTest_TriangleMesh(mesh, ray, temp, true);
-		}
+			const __m256 v{ _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dirX, qX), _mm256_mul_ps(dirY, qY)), _mm256_mul_ps(dirZ, qZ))) };
 
-#pragma endregion
-	}
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, minBarycentric, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), maxBarycentric, _CMP_LE_OQ)));
+
+			const __m256 t{ _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge2X, qX), _mm256_mul_ps(edge2Y, qY)), _mm256_mul_ps(edge2Z, qZ))) };
+
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(ray.min), _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(ray.max), _CMP_LE_OQ)));
+			if constexpr (Query == RayQuery::ClosestHit)
+			{
+				valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(closestT), _CMP_LT_OQ));
+			}
+
+			const int hitMask{ _mm256_movemask_ps(valid) };
+
+			if (hitMask == 0) return -1;
+
+			if constexpr (Query == RayQuery::Occlusion) return std::countr_zero(static_cast<unsigned int>(hitMask));
+
+			alignas(32) float laneT[8];
+			alignas(32) float laneU[8];
+			alignas(32) float laneV[8];
+			_mm256_store_ps(laneT, t);
+			_mm256_store_ps(laneU, u);
+			_mm256_store_ps(laneV, v);
+
+			const int closestLane{ GetClosestLane(hitMask, laneT) };
+			tHit = laneT[closestLane];
+			uHit = laneU[closestLane];
+			vHit = laneV[closestLane];
+
+			return closestLane;
+		}
+
+		//Widest triangle kernel the CPU runs, meshes size their BVH leaves to it
+		inline size_t GetTrianglePacketWidth(Utils::SIMDLevel simdLevel)
+		{
+			return simdLevel == Utils::SIMDLevel::AVX2 ? TriangleSoA::maxSIMDWidth : 4;
+		}
+
+		//Width of the next packet of a triangle range, leaves of 4 triangles or less go through the 4 wide kernel
+		//so half the lanes of the 8 wide one don't idle, bigger leaves and longer ranges take it
+		inline size_t GetTrianglePacketWidth(Utils::SIMDLevel simdLevel, size_t remainingTriangles)
+		{
+			return remainingTriangles > 4 ? GetTrianglePacketWidth(simdLevel) : 4;
+		}
+
+		//Tests a contiguous range of triangles of a mesh with the widest kernel that fills up, falling back to one triangle at a time
+		//candidate only gets replaced by hits in front of it
+		inline bool HitTest_Triangles(const TriangleMesh& mesh, size_t firstTriangle, size_t triangleCount, TriangleCullMode cullMode, unsigned char materialIndex, const Ray& ray, HitCandidate& candidate)
+		{
+			const TriangleSoA& triangles{ mesh.triangles };
+			const Utils::SIMDLevel simdLevel{ Utils::GetSIMDLevel() };
+
+			float closestT{ candidate.t };
+			float closestU{}, closestV{};
+			size_t closestTriangle{ SIZE_MAX };
+
+			if (simdLevel == Utils::SIMDLevel::Scalar)
+			{
+				for (size_t triangleIdx{ firstTriangle }; triangleIdx < firstTriangle + triangleCount; ++triangleIdx)
+				{
+					float t{}, u{}, v{};
+
+					if (HitTest_Triangle(triangles.GetV0(triangleIdx), triangles.GetEdge1(triangleIdx), triangles.GetEdge2(triangleIdx), triangles.GetNormal(triangleIdx), cullMode, ray, t, u, v) && t < closestT)
+					{
+						closestT = t;
+						closestU = u;
+						closestV = v;
+						closestTriangle = triangleIdx;
+					}
+				}
+			}
+			else
+			{
+				for (size_t packetStart{ firstTriangle }, width{}; packetStart < firstTriangle + triangleCount; packetStart += width)
+				{
+					width = GetTrianglePacketWidth(simdLevel, firstTriangle + triangleCount - packetStart);
+
+					const size_t packetCount{ std::min(width, firstTriangle + triangleCount - packetStart) };
+
+					float tHit{}, uHit{}, vHit{};
+					const int lane{ width == 4
+						? HitTest_Triangle4(triangles, packetStart, packetCount, cullMode, ray, closestT, tHit, uHit, vHit)
+						: HitTest_Triangle8(triangles, packetStart, packetCount, cullMode, ray, closestT, tHit, uHit, vHit) };
+
+					if (lane < 0) continue;
+
+					closestT = tHit;
+					closestU = uHit;
+					closestV = vHit;
+					closestTriangle = packetStart + lane;
+				}
+			}
+
+			if (closestTriangle == SIZE_MAX) return false;
+
+			candidate = {};
+			candidate.t = closestT;
+			candidate.u = closestU;
+			candidate.v = closestV;
+			candidate.primitiveIdx = static_cast<uint32_t>(closestTriangle);
+			candidate.pMesh = &mesh;
+			candidate.type = HitPrimitiveType::Triangle;
+			candidate.materialIndex = materialIndex;
+
+			return true;
+		}
+
+		//Occlusion version of HitTest_Triangles, cullMode is the one of the mesh and gets flipped here
+		inline bool Occluded_Triangles(const TriangleMesh& mesh, size_t firstTriangle, size_t triangleCount, TriangleCullMode cullMode, const Ray& ray)
+		{
+			const TriangleSoA& triangles{ mesh.triangles };
+			const Utils::SIMDLevel simdLevel{ Utils::GetSIMDLevel() };
+			const TriangleCullMode rayCullMode{ GetRayCullMode<RayQuery::Occlusion>(cullMode) };
+
+			if (simdLevel == Utils::SIMDLevel::Scalar)
+			{
+				for (size_t triangleIdx{ firstTriangle }; triangleIdx < firstTriangle + triangleCount; ++triangleIdx)
+				{
+					float t{}, u{}, v{};
+
+					if (HitTest_Triangle(triangles.GetV0(triangleIdx), triangles.GetEdge1(triangleIdx), triangles.GetEdge2(triangleIdx), triangles.GetNormal(triangleIdx), rayCullMode, ray, t, u, v)) return true;
+				}
+
+				return false;
+			}
+
+			for (size_t packetStart{ firstTriangle }, width{}; packetStart < firstTriangle + triangleCount; packetStart += width)
+			{
+				width = GetTrianglePacketWidth(simdLevel, firstTriangle + triangleCount - packetStart);
+
+				const size_t packetCount{ std::min(width, firstTriangle + triangleCount - packetStart) };
+
+				float tHit{}, uHit{}, vHit{};
+				const int lane{ width == 4
+					? HitTest_Triangle4<RayQuery::Occlusion>(triangles, packetStart, packetCount, rayCullMode, ray, ray.max, tHit, uHit, vHit)
+					: HitTest_Triangle8<RayQuery::Occlusion>(triangles, packetStart, packetCount, rayCullMode, ray, ray.max, tHit, uHit, vHit) };
+
+				if (lane >= 0) return true;
+			}
+
+			return false;
+		}
+
+		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray)
+		{
+			HitRecord temp{};
+			return HitTest_Triangle(triangle, ray, temp, true);
+		}
+#pragma endregion
+#pragma region TriangeMesh HitTest
+
+		//Returns the distance at which the ray enters the box, FLT_MAX when it misses it
+		inline float SlabTest_Distance(const Ray& ray, const Vector3& minAABB, const Vector3& maxAABB)
+		{
+
+			const float tx1 {(minAABB.x - ray.origin.x) * ray.inverseDirection.x};
+			const float tx2 {(maxAABB.x - ray.origin.x) * ray.inverseDirection.x};
+
+			float tmin = std::min(tx1, tx2);
+			float tmax = std::max(tx1, tx2);
+
+			const float ty1 {(minAABB.y - ray.origin.y) * ray.inverseDirection.y};
+			const float ty2 {(maxAABB.y - ray.origin.y) * ray.inverseDirection.y};
+
+			tmin = std::max(tmin, std::min(ty1, ty2));
+			tmax = std::min(tmax, std::max(ty1, ty2));
+
+			const float tz1 {(minAABB.z - ray.origin.z) * ray.inverseDirection.z};
+			const float tz2 {(maxAABB.z - ray.origin.z) * ray.inverseDirection.z};
+
+			tmin = std::max(tmin, std::min(tz1, tz2));
+			tmax = std::min(tmax, std::max(tz1, tz2));
+
+			return (tmax > 0 && tmax >= tmin) ? tmin : FLT_MAX;
+
+		}
+
+		inline bool SlabTest_TriangleMesh(const Ray& ray, const Vector3& minAABB, const Vector3& maxAABB)
+		{
+			return SlabTest_Distance(ray, minAABB, maxAABB) != FLT_MAX;
+		}
+
+		//Slab test of one ray against the 4 children of a BVH4Node, returns a bitmask of the children that got hit before maxT
+		//and writes the distance at which the ray enters each of them to tEntry
+		inline int SlabTest_BVH4Node(const BVH4Node& node, const __m128 origin[3], const __m128 inverseDirection[3], __m128 maxT, float tEntry[4])
+		{
+			const __m128 tx1{ _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX), origin[0]), inverseDirection[0]) };
+			const __m128 tx2{ _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX), origin[0]), inverseDirection[0]) };
+
+			__m128 tmin{ _mm_min_ps(tx1, tx2) };
+			__m128 tmax{ _mm_max_ps(tx1, tx2) };
+
+			const __m128 ty1{ _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY), origin[1]), inverseDirection[1]) };
+			const __m128 ty2{ _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY), origin[1]), inverseDirection[1]) };
+
+			tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+
+			const __m128 tz1{ _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ), origin[2]), inverseDirection[2]) };
+			const __m128 tz2{ _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ), origin[2]), inverseDirection[2]) };
+
+			tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+
+			_mm_storeu_ps(tEntry, tmin);
+
+			const __m128 hit{ _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(tmax, _mm_setzero_ps()), _mm_cmpge_ps(tmax, tmin)), _mm_cmple_ps(tmin, maxT)) };
+
+			//empty slots have garbage bounds, mask them out
+			const __m128i empty{ _mm_cmpeq_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(node.child)), _mm_set1_epi32(-1)) };
+
+			return _mm_movemask_ps(_mm_andnot_ps(_mm_castsi128_ps(empty), hit));
+		}
+
+		inline bool IntersectBVHLeaf(const TriangleMesh& mesh, TriangleCullMode cullMode, unsigned char materialIndex, const Ray& ray, HitCandidate& candidate, size_t firstIndice, size_t indiceCount)
+		{
+			return HitTest_Triangles(mesh, firstIndice / 3, indiceCount / 3, cullMode, materialIndex, ray, candidate);
+		}
+
+		struct BVHStackEntry
+		{
+			uint32_t nodeIdx{};
+			float tEntry{};
+		};
+
+		//Closest hit traversal, children are visited front to back and anything starting behind the closest hit is skipped
+		inline bool IntersectBVH(const TriangleMesh& mesh, TriangleCullMode cullMode, unsigned char materialIndex, const Ray& ray, HitCandidate& candidate)
+		{
+			const __m128 origin[3]{ _mm_set1_ps(ray.origin.x), _mm_set1_ps(ray.origin.y), _mm_set1_ps(ray.origin.z) };
+			const __m128 inverseDirection[3]{ _mm_set1_ps(ray.inverseDirection.x), _mm_set1_ps(ray.inverseDirection.y), _mm_set1_ps(ray.inverseDirection.z) };
+
+			//every level pushes at most 3 more nodes than it pops
+			BVHStackEntry nodeStack[256];
+			size_t stackSize{};
+
+			bool hasHit{ false };
+
+			nodeStack[stackSize++] = { 0, -FLT_MAX };
+
+			while (stackSize > 0)
+			{
+				const BVHStackEntry entry{ nodeStack[--stackSize] };
+
+				//the closest hit might have moved in front of this node since it got pushed
+				if (entry.tEntry > std::min(candidate.t, ray.max)) continue;
+
+				const BVH4Node& node{ mesh.wideBVHNodes[entry.nodeIdx] };
+
+				float tEntry[4];
+				int hitMask{ SlabTest_BVH4Node(node, origin, inverseDirection, _mm_set1_ps(std::min(candidate.t, ray.max)), tEntry) };
+
+				//insertion sort of the hit children from near to far, there are at most 4
+				int order[4];
+				int hitCount{};
+
+				while (hitMask != 0)
+				{
+					const int childIdx{ std::countr_zero(static_cast<unsigned int>(hitMask)) };
+					hitMask &= hitMask - 1;
+
+					int insertIdx{ hitCount++ };
+
+					while (insertIdx > 0 && tEntry[order[insertIdx - 1]] > tEntry[childIdx])
+					{
+						order[insertIdx] = order[insertIdx - 1];
+						--insertIdx;
+					}
+
+					order[insertIdx] = childIdx;
+				}
+
+				//interior children go on the stack far to near so the nearest one gets popped first
+				for (int i{ hitCount - 1 }; i >= 0; --i)
+				{
+					const int childIdx{ order[i] };
+
+					if (node.count[childIdx] > 0) continue;
+
+					assert(stackSize < 256);
+
+					nodeStack[stackSize++] = { node.child[childIdx], tEntry[childIdx] };
+				}
+
+				for (int i{}; i < hitCount; ++i)
+				{
+					const int childIdx{ order[i] };
+
+					if (node.count[childIdx] == 0 || tEntry[childIdx] > candidate.t) continue;
+
+					if (IntersectBVHLeaf(mesh, cullMode, materialIndex, ray, candidate, node.child[childIdx], node.count[childIdx]))
+					{
+						hasHit = true;
+					}
+				}
+			}
+
+			return hasHit;
+		}
+
+		//Any hit traversal for shadow rays, order doesn't matter since the first occluder ends the search
+		inline bool IntersectBVH_AnyHit(const TriangleMesh& mesh, TriangleCullMode cullMode, const Ray& ray)
+		{
+			const __m128 origin[3]{ _mm_set1_ps(ray.origin.x), _mm_set1_ps(ray.origin.y), _mm_set1_ps(ray.origin.z) };
+			const __m128 inverseDirection[3]{ _mm_set1_ps(ray.inverseDirection.x), _mm_set1_ps(ray.inverseDirection.y), _mm_set1_ps(ray.inverseDirection.z) };
+			const __m128 maxT{ _mm_set1_ps(ray.max) };
+
+			uint32_t nodeStack[256];
+			size_t stackSize{};
+
+			nodeStack[stackSize++] = 0;
+
+			while (stackSize > 0)
+			{
+				const BVH4Node& node{ mesh.wideBVHNodes[nodeStack[--stackSize]] };
+
+				float tEntry[4];
+				int hitMask{ SlabTest_BVH4Node(node, origin, inverseDirection, maxT, tEntry) };
+
+				while (hitMask != 0)
+				{
+					const int childIdx{ std::countr_zero(static_cast<unsigned int>(hitMask)) };
+					hitMask &= hitMask - 1;
+
+					if (node.count[childIdx] > 0)
+					{
+						if (Occluded_Triangles(mesh, node.child[childIdx] / 3, node.count[childIdx] / 3, cullMode, ray)) return true;
+					}
+					else
+					{
+						assert(stackSize < 256);
+
+						nodeStack[stackSize++] = node.child[childIdx];
+					}
+				}
+			}
+
+			return false;
+		}
+
+		//SSE copy of the origins and inverse directions of a packet, built once per traversal
+		struct RayPacketSoA
+		{
+			__m128 origin[3]{};
+			__m128 inverseDirection[3]{};
+
+			explicit RayPacketSoA(const RayPacket& packet)
+			{
+				const Ray* rays{ packet.rays };
+
+				origin[0] = _mm_setr_ps(rays[0].origin.x, rays[1].origin.x, rays[2].origin.x, rays[3].origin.x);
+				origin[1] = _mm_setr_ps(rays[0].origin.y, rays[1].origin.y, rays[2].origin.y, rays[3].origin.y);
+				origin[2] = _mm_setr_ps(rays[0].origin.z, rays[1].origin.z, rays[2].origin.z, rays[3].origin.z);
+
+				inverseDirection[0] = _mm_setr_ps(rays[0].inverseDirection.x, rays[1].inverseDirection.x, rays[2].inverseDirection.x, rays[3].inverseDirection.x);
+				inverseDirection[1] = _mm_setr_ps(rays[0].inverseDirection.y, rays[1].inverseDirection.y, rays[2].inverseDirection.y, rays[3].inverseDirection.y);
+				inverseDirection[2] = _mm_setr_ps(rays[0].inverseDirection.z, rays[1].inverseDirection.z, rays[2].inverseDirection.z, rays[3].inverseDirection.z);
+			}
+		};
+
+		//Slab test of the 4 rays of a packet against one box, returns a bitmask of the rays that enter it before their maxT
+		inline int SlabTest_Packet(const Vector3& minAABB, const Vector3& maxAABB, const RayPacketSoA& packet, __m128 maxT)
+		{
+			const __m128 tx1{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minAABB.x), packet.origin[0]), packet.inverseDirection[0]) };
+			const __m128 tx2{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxAABB.x), packet.origin[0]), packet.inverseDirection[0]) };
+
+			__m128 tmin{ _mm_min_ps(tx1, tx2) };
+			__m128 tmax{ _mm_max_ps(tx1, tx2) };
+
+			const __m128 ty1{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minAABB.y), packet.origin[1]), packet.inverseDirection[1]) };
+			const __m128 ty2{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxAABB.y), packet.origin[1]), packet.inverseDirection[1]) };
+
+			tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+
+			const __m128 tz1{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minAABB.z), packet.origin[2]), packet.inverseDirection[2]) };
+			const __m128 tz2{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxAABB.z), packet.origin[2]), packet.inverseDirection[2]) };
+
+			tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+
+			const __m128 hit{ _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(tmax, _mm_setzero_ps()), _mm_cmpge_ps(tmax, tmin)), _mm_cmple_ps(tmin, maxT)) };
+
+			return _mm_movemask_ps(hit);
+		}
+
+		//Packet traversal of the binary tree, a node is entered as long as any active ray hits it
+		//so one node fetch and one slab test serve the whole packet
+		inline void IntersectBVH_Packet(const TriangleMesh& mesh, TriangleCullMode cullMode, unsigned char materialIndex, const RayPacket& packet, HitCandidate candidates[RayPacket::Size], int laneMask)
+		{
+			const RayPacketSoA packetSoA{ packet };
+
+			//the packet is coherent, any of its rays gives the same near child
+			const Vector3& direction{ packet.rays[std::countr_zero(static_cast<unsigned int>(laneMask))].direction };
+
+			alignas(16) float maxT[RayPacket::Size]{};
+
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				maxT[lane] = std::min(candidates[lane].t, packet.rays[lane].max);
+			}
+
+			uint32_t nodeStack[256];
+			size_t stackSize{};
+
+			nodeStack[stackSize++] = static_cast<uint32_t>(mesh.rootNodeIdx);
+
+			while (stackSize > 0)
+			{
+				const BVHNode& node{ mesh.bvhNodes[nodeStack[--stackSize]] };
+
+				int hitMask{ SlabTest_Packet(node.minAABB, node.maxAABB, packetSoA, _mm_load_ps(maxT)) & laneMask };
+
+				if (hitMask == 0) continue;
+
+				if (node.IsLeaf())
+				{
+					while (hitMask != 0)
+					{
+						const int lane{ std::countr_zero(static_cast<unsigned int>(hitMask)) };
+						hitMask &= hitMask - 1;
+
+						HitTest_Triangles(mesh, node.leftFirst / 3, node.IndiceCount / 3, cullMode, materialIndex, packet.rays[lane], candidates[lane]);
+
+						maxT[lane] = std::min(candidates[lane].t, packet.rays[lane].max);
+					}
+
+					continue;
+				}
+
+				const uint32_t leftChildIdx{ node.leftFirst };
+				const uint32_t rightChildIdx{ leftChildIdx + 1 };
+
+				const BVHNode& leftChild{ mesh.bvhNodes[leftChildIdx] };
+				const BVHNode& rightChild{ mesh.bvhNodes[rightChildIdx] };
+
+				//both children share a cache line, so comparing their centers along the packet direction is cheap
+				const Vector3 leftToRight{ (rightChild.minAABB + rightChild.maxAABB) - (leftChild.minAABB + leftChild.maxAABB) };
+
+				assert(stackSize + 2 <= 256);
+
+				//far child first so the near one gets popped first
+				if (Vector3::Dot(leftToRight, direction) >= 0.f)
+				{
+					nodeStack[stackSize++] = rightChildIdx;
+					nodeStack[stackSize++] = leftChildIdx;
+				}
+				else
+				{
+					nodeStack[stackSize++] = leftChildIdx;
+					nodeStack[stackSize++] = rightChildIdx;
+				}
+			}
+		}
+
+		//Rebuilds the full hit of a triangle candidate, ray has to be the world space ray the candidate was found with
+		inline void FinalizeTriangleHit(const HitCandidate& candidate, const Ray& ray, HitRecord& hitRecord)
+		{
+			const Vector3 normal{ candidate.pMesh->triangles.GetNormal(candidate.primitiveIdx) };
+
+			hitRecord.didHit = true;
+			hitRecord.materialIndex = candidate.materialIndex;
+			hitRecord.origin = ray.origin + (ray.direction * candidate.t);
+			hitRecord.normal = candidate.pInstance ? candidate.pInstance->normalToWorld.TransformVector(normal).Normalized() : normal;
+			hitRecord.t = candidate.t;
+		}
+
+		//cullMode and materialIndex are passed separately so instances can override the ones of the shared mesh
+		//returns true when candidate got replaced by a closer hit
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, TriangleCullMode cullMode, unsigned char materialIndex, const Ray& ray, HitCandidate& candidate)
+		{
+			//meshes with a built tree traverse it, the root children bounds double as the mesh AABB test
+			if (mesh.HasBVH())
+			{
+				return IntersectBVH(mesh, cullMode, materialIndex, ray, candidate);
+			}
+
+			if (!SlabTest_TriangleMesh(ray, mesh.transformedMinAABB, mesh.transformedMaxAABB))
+			{ 
+				return false; 
+			}
+
+			return HitTest_Triangles(mesh, 0, mesh.triangles.count, cullMode, materialIndex, ray, candidate);
+
+		}
+
+		//Occlusion version of HitTest_TriangleMesh, true as soon as anything between ray.min and ray.max gets hit
+		inline bool Occluded_TriangleMesh(const TriangleMesh& mesh, TriangleCullMode cullMode, const Ray& ray)
+		{
+			if (mesh.HasBVH())
+			{
+				return IntersectBVH_AnyHit(mesh, cullMode, ray);
+			}
+
+			if (!SlabTest_TriangleMesh(ray, mesh.transformedMinAABB, mesh.transformedMaxAABB))
+			{
+				return false;
+			}
+
+			return Occluded_Triangles(mesh, 0, mesh.triangles.count, cullMode, ray);
+		}
+
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			if (ignoreHitRecord)
+			{
+				return Occluded_TriangleMesh(mesh, mesh.cullMode, ray);
+			}
+
+			HitCandidate candidate{};
+
+			if (!HitTest_TriangleMesh(mesh, mesh.cullMode, mesh.materialIndex, ray, candidate)) return false;
+
+			FinalizeTriangleHit(candidate, ray, hitRecord);
+
+			return true;
+		}
+
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
+		{
+			return Occluded_TriangleMesh(mesh, mesh.cullMode, ray);
+		}
+
+		//Packet version of HitTest_TriangleMesh, the candidates of the lanes in laneMask only get replaced by closer hits
+		inline void HitTest_TriangleMeshPacket(const TriangleMesh& mesh, TriangleCullMode cullMode, unsigned char materialIndex, const RayPacket& packet, HitCandidate candidates[RayPacket::Size], int laneMask)
+		{
+			//a lone ray is faster through the 4 wide tree, and diverging rays would drag each other through all of it
+			if (!mesh.HasBVH() || std::popcount(static_cast<unsigned int>(laneMask)) < 2 || !packet.IsCoherent())
+			{
+				while (laneMask != 0)
+				{
+					const int lane{ std::countr_zero(static_cast<unsigned int>(laneMask)) };
+					laneMask &= laneMask - 1;
+
+					HitTest_TriangleMesh(mesh, cullMode, materialIndex, packet.rays[lane], candidates[lane]);
+				}
+
+				return;
+			}
+
+			IntersectBVH_Packet(mesh, cullMode, materialIndex, packet, candidates, laneMask);
+		}
+
+		inline void HitTest_TriangleMeshPacket(const TriangleMesh& mesh, const RayPacket& packet, HitCandidate candidates[RayPacket::Size], int laneMask)
+		{
+			HitTest_TriangleMeshPacket(mesh, mesh.cullMode, mesh.materialIndex, packet, candidates, laneMask);
+		}
+
+		inline bool HitTest_TriangleMeshInstance(const TriangleMeshInstance& instance, const Ray& ray, HitCandidate& candidate)
+		{
+			if (!SlabTest_TriangleMesh(ray, instance.transformedMinAABB, instance.transformedMaxAABB))
+			{
+				return false;
+			}
+
+			//the direction is not renormalized, that way t means the same distance in object and world space
+			const Ray objectRay{ instance.worldToObject.TransformPoint(ray.origin), instance.worldToObject.TransformVector(ray.direction), ray.min, ray.max };
+
+			//so the closest hit so far keeps culling in object space
+			HitCandidate objectCandidate{};
+			objectCandidate.t = candidate.t;
+
+			if (!HitTest_TriangleMesh(*instance.pMesh, instance.cullMode, instance.materialIndex, objectRay, objectCandidate))
+			{
+				return false;
+			}
+
+			candidate = objectCandidate;
+			candidate.pInstance = &instance;
+
+			return true;
+		}
+
+		inline bool Occluded_TriangleMeshInstance(const TriangleMeshInstance& instance, const Ray& ray)
+		{
+			if (!SlabTest_TriangleMesh(ray, instance.transformedMinAABB, instance.transformedMaxAABB))
+			{
+				return false;
+			}
+
+			const Ray objectRay{ instance.worldToObject.TransformPoint(ray.origin), instance.worldToObject.TransformVector(ray.direction), ray.min, ray.max };
+
+			return Occluded_TriangleMesh(*instance.pMesh, instance.cullMode, objectRay);
+		}
+
+		inline bool HitTest_TriangleMeshInstance(const TriangleMeshInstance& instance, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			if (ignoreHitRecord)
+			{
+				return Occluded_TriangleMeshInstance(instance, ray);
+			}
+
+			HitCandidate candidate{};
+
+			if (!HitTest_TriangleMeshInstance(instance, ray, candidate)) return false;
+
+			FinalizeTriangleHit(candidate, ray, hitRecord);
+
+			return true;
+		}
+
+		inline bool HitTest_TriangleMeshInstance(const TriangleMeshInstance& instance, const Ray& ray)
+		{
+			return Occluded_TriangleMeshInstance(instance, ray);
+		}
+
+		inline void HitTest_TriangleMeshInstancePacket(const TriangleMeshInstance& instance, const RayPacket& packet, HitCandidate candidates[RayPacket::Size], int laneMask)
+		{
+			RayPacket objectPacket{};
+			HitCandidate objectCandidates[RayPacket::Size]{};
+			int objectMask{};
+
+			for (int lane{}; lane < RayPacket::Size; ++lane)
+			{
+				const Ray& ray{ packet.rays[lane] };
+
+				objectPacket.rays[lane] = Ray{ instance.worldToObject.TransformPoint(ray.origin), instance.worldToObject.TransformVector(ray.direction), ray.min, ray.max };
+
+				//t is the same in both spaces, so the closest hit so far keeps culling in object space
+				objectCandidates[lane].t = candidates[lane].t;
+
+				if ((laneMask & (1 << lane)) && SlabTest_TriangleMesh(ray, instance.transformedMinAABB, instance.transformedMaxAABB))
+				{
+					objectMask |= 1 << lane;
+				}
+			}
+
+			if (objectMask == 0) return;
+
+			HitTest_TriangleMeshPacket(*instance.pMesh, instance.cullMode, instance.materialIndex, objectPacket, objectCandidates, objectMask);
+
+			while (objectMask != 0)
+			{
+				const int lane{ std::countr_zero(static_cast<unsigned int>(objectMask)) };
+				objectMask &= objectMask - 1;
+
+				if (!objectCandidates[lane].DidHit()) continue;
+
+				candidates[lane] = objectCandidates[lane];
+				candidates[lane].pInstance = &instance;
+			}
+		}
+
+#pragma endregion
+	}
 
 	namespace LightUtils
 	{
@@ -513,6 +1513,32 @@ namespace dae
 				return light.color * light.intensity;
 			}
 		}
+
+		//Intensity of the strongest color channel
+		inline float GetPower(const Light& light)
+		{
+			return light.intensity * std::max(light.color.r, std::max(light.color.g, light.color.b));
+		}
+
+		//Distance at which the strongest channel of a point light's radiance drops below radianceCutoff
+		inline float GetInfluenceRadius(const Light& light, float radianceCutoff)
+		{
+			if (light.type != LightType::Point || radianceCutoff <= 0.f) return FLT_MAX;
+
+			return sqrtf(GetPower(light) / radianceCutoff);
+		}
+
+		//Estimated contribution of the lights of a light BVH node at position, their power over the squared distance
+		//the distance is clamped to half the node diagonal, so points inside a big node don't favour one side too much
+		inline float GetImportance(const LightBVHNode& node, const Vector3& position)
+		{
+			const Vector3 center{ (node.minAABB + node.maxAABB) * 0.5f };
+			const float halfDiagonalSquared{ (node.maxAABB - node.minAABB).SqrMagnitude() * 0.25f };
+
+			const float distanceSquared{ std::max((center - position).SqrMagnitude(), std::max(halfDiagonalSquared, 1e-4f)) };
+
+			return node.power / distanceSquared;
+		}
 	}
 
 	namespace Utils
@@ -524,74 +1550,130 @@ namespace dae
 		//	return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ps1(arg)));
 		//}
 
+		//Skips the blanks in front of a number and reads it out of [pCursor, pEnd), returns where the number ended
+		//from_chars needs no terminator, so the lines get parsed right in the file buffer, value stays untouched when there is no number
+		template<typename T>
+		inline const char* ParseOBJNumber(const char* pCursor, const char* pEnd, T& value)
+		{
+			while (pCursor < pEnd && (*pCursor == ' ' || *pCursor == '\t' || *pCursor == '+')) ++pCursor;
+
+			return std::from_chars(pCursor, pEnd, value).ptr;
+		}
+
+		//Parses the v and f lines of text, faces are plain vertex indices and become 0 based
+		inline void ParseOBJLines(const char* pBegin, const char* pEnd, std::vector<Vector3>& positions, std::vector<int>& indices)
+		{
+			const char* pLine{ pBegin };
+
+			while (pLine < pEnd)
+			{
+				const char* pLineEnd{ std::find(pLine, pEnd, '\n') };
+				const char* pCursor{ pLine };
+
+				while (pCursor < pLineEnd && (*pCursor == ' ' || *pCursor == '\t')) ++pCursor;
+
+				const bool hasKeyword{ pLineEnd - pCursor > 1 && (pCursor[1] == ' ' || pCursor[1] == '\t') };
+
+				if (hasKeyword && pCursor[0] == 'v')
+				{
+					//Vertex
+					Vector3 position{};
+					pCursor = ParseOBJNumber(pCursor + 1, pLineEnd, position.x);
+					pCursor = ParseOBJNumber(pCursor, pLineEnd, position.y);
+					ParseOBJNumber(pCursor, pLineEnd, position.z);
+
+					positions.push_back(position);
+				}
+				else if (hasKeyword && pCursor[0] == 'f')
+				{
+					int faceIndices[3]{};
+					pCursor = ParseOBJNumber(pCursor + 1, pLineEnd, faceIndices[0]);
+					pCursor = ParseOBJNumber(pCursor, pLineEnd, faceIndices[1]);
+					ParseOBJNumber(pCursor, pLineEnd, faceIndices[2]);
+
+					indices.push_back(faceIndices[0] - 1);
+					indices.push_back(faceIndices[1] - 1);
+					indices.push_back(faceIndices[2] - 1);
+				}
+
+				pLine = pLineEnd + 1;
+			}
+		}
+
 		//Just parses vertices and indices
+		//the file gets cut into chunks at line ends that are parsed on the shared thread pool and stitched back together in order
 #pragma warning(push)
 #pragma warning(disable : 4505) //Warning unreferenced local function
 		static bool ParseOBJ(const std::string& filename, std::vector<Vector3>& positions, std::vector<Vector3>& normals, std::vector<int>& indices)
 		{
-			std::ifstream file(filename);
+			std::ifstream file(filename, std::ios::binary);
 			if (!file)
 				return false;
 
-			std::string sCommand;
-			// start a while iteration ending when the end of file is reached (ios::eof)
-			while (!file.eof())
+			const std::string text{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+
+			const char* pText{ text.data() };
+			const char* pTextEnd{ pText + text.size() };
+
+			const size_t chunkSize{ 64 * 1024 };
+
+			std::vector<const char*> chunkBegins{ pText };
+
+			while (pTextEnd - chunkBegins.back() > static_cast<std::ptrdiff_t>(chunkSize))
 			{
-				//read the first word of the string, use the >> operator (istream::operator>>) 
-				file >> sCommand;
-				//use conditional statements to process the different commands	
-				if (sCommand == "#")
-				{
-					// Ignore Comment
-				}
-				else if (sCommand == "v")
-				{
-					//Vertex
-					float x, y, z;
-					file >> x >> y >> z;
-					positions.push_back({ x, y, z });
-				}
-				else if (sCommand == "f")
-				{
-					float i0, i1, i2;
-					file >> i0 >> i1 >> i2;
+				const char* pChunkEnd{ std::find(chunkBegins.back() + chunkSize, pTextEnd, '\n') };
 
-					indices.push_back((int)i0 - 1);
-					indices.push_back((int)i1 - 1);
-					indices.push_back((int)i2 - 1);
-				}
-				//read till end of line and ignore all remaining chars
-				file.ignore(1000, '\n');
+				if (pChunkEnd == pTextEnd) break;
 
-				if (file.eof()) 
-					break;
+				chunkBegins.push_back(pChunkEnd + 1);
 			}
 
-			//Precompute normals
-			for (uint64_t index = 0; index < indices.size(); index += 3)
-			{
-				uint32_t i0 = indices[index];
-				uint32_t i1 = indices[index + 1];
-				uint32_t i2 = indices[index + 2];
+			const size_t chunkCount{ chunkBegins.size() };
 
-				Vector3 edgeV0V1 = positions[i1] - positions[i0];
-				Vector3 edgeV0V2 = positions[i2] - positions[i0];
-				Vector3 normal = Vector3::Cross(edgeV0V1, edgeV0V2);
+			std::vector<std::vector<Vector3>> chunkPositions(chunkCount);
+			std::vector<std::vector<int>> chunkIndices(chunkCount);
 
-				if(isnan(normal.x))
+			ThreadPool::GetShared().ParallelFor(chunkCount, 1, [&](size_t firstChunk, size_t endChunk)
 				{
-					int k = 0;
-				}
+					for (size_t chunkIdx{ firstChunk }; chunkIdx < endChunk; ++chunkIdx)
+					{
+						const char* pChunkEnd{ chunkIdx + 1 < chunkCount ? chunkBegins[chunkIdx + 1] : pTextEnd };
 
-				normal.Normalize();
-				if (isnan(normal.x))
-				{
-					int k = 0;
-				}
+						ParseOBJLines(chunkBegins[chunkIdx], pChunkEnd, chunkPositions[chunkIdx], chunkIndices[chunkIdx]);
+					}
+				});
 
-				normals.push_back(normal);
+			//indices in obj files are absolute, so the chunks can simply be appended
+			for (size_t chunkIdx{}; chunkIdx < chunkCount; ++chunkIdx)
+			{
+				positions.insert(positions.end(), chunkPositions[chunkIdx].begin(), chunkPositions[chunkIdx].end());
+				indices.insert(indices.end(), chunkIndices[chunkIdx].begin(), chunkIndices[chunkIdx].end());
 			}
 
+			//Precompute normals
+			const size_t firstNormal{ normals.size() };
+			normals.resize(firstNormal + indices.size() / 3);
+
+			ThreadPool::GetShared().ParallelFor(indices.size() / 3, TriangleMesh::minParallelItems, [&](size_t firstTriangle, size_t endTriangle)
+				{
+					for (size_t triangleIdx{ firstTriangle }; triangleIdx < endTriangle; ++triangleIdx)
+					{
+						const size_t index{ triangleIdx * 3 };
+
+						uint32_t i0 = indices[index];
+						uint32_t i1 = indices[index + 1];
+						uint32_t i2 = indices[index + 2];
+
+						Vector3 edgeV0V1 = positions[i1] - positions[i0];
+						Vector3 edgeV0V2 = positions[i2] - positions[i0];
+						Vector3 normal = Vector3::Cross(edgeV0V1, edgeV0V2);
+
+						normal.Normalize();
+
+						normals[firstNormal + triangleIdx] = normal;
+					}
+				});
+
 			return true;
 		}
 #pragma warning(pop)
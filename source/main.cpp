@@ -1,42 +1,148 @@
 //External includes
+#if defined(_MSC_VER)
 #include "vld.h"
+#endif
 #include "SDL.h"
 #include "SDL_surface.h"
 #undef main
 
 //Standard includes
+#include <cstdlib>
 #include <iostream>
+#include <string>
 
 //Project includes
 #include "Timer.h"
 #include "Renderer.h"
 #include "Scene.h"
+#include "ThreadPool.h"
 
 using namespace dae;
 
+//RayTracer [--headless] [--frames N] [--output file.bmp] [--scene w1|w2|w3|w4|reference|bunny|manylights] [--width W] [--height H] [--many-lights]
+//          [--threads N] [--pin-threads]
+//frames and output only matter when headless, the window saves its screenshots to the default output
+//threads 0 uses every hardware thread, pin-threads locks each worker thread to its own hardware thread
+struct Options
+{
+	bool isHeadless{ false };
+	bool manyLightsEnabled{ false };
+	bool pinThreads{ false };
+	int frameCount{ 1 };
+	int threadCount{ 0 };
+	int width{ 640 };
+	int height{ 480 };
+	std::string sceneName{ "reference" };
+	std::string outputPath{ "RayTracing_Buffer.bmp" };
+};
+
+bool ParseOptions(int argc, char* args[], Options& options)
+{
+	for (int i{ 1 }; i < argc; ++i)
+	{
+		const std::string argument{ args[i] };
+		const bool hasValue{ i + 1 < argc };
+
+		if (argument == "--headless") options.isHeadless = true;
+		else if (argument == "--many-lights") options.manyLightsEnabled = true;
+		else if (argument == "--pin-threads") options.pinThreads = true;
+		else if (argument == "--frames" && hasValue) options.frameCount = std::atoi(args[++i]);
+		else if (argument == "--threads" && hasValue) options.threadCount = std::atoi(args[++i]);
+		else if (argument == "--width" && hasValue) options.width = std::atoi(args[++i]);
+		else if (argument == "--height" && hasValue) options.height = std::atoi(args[++i]);
+		else if (argument == "--scene" && hasValue) options.sceneName = args[++i];
+		else if (argument == "--output" && hasValue) options.outputPath = args[++i];
+		else
+		{
+			std::cout << "Unknown or incomplete argument: " << argument << std::endl;
+			return false;
+		}
+	}
+
+	return options.frameCount > 0 && options.threadCount >= 0 && options.width > 0 && options.height > 0;
+}
+
+Scene* CreateScene(const std::string& sceneName)
+{
+	if (sceneName == "w1") return new Scene_W1();
+	if (sceneName == "w2") return new Scene_W2();
+	if (sceneName == "w3") return new Scene_W3();
+	if (sceneName == "w4") return new Scene_W4();
+	if (sceneName == "reference") return new Scene_W4_ReferenceScene();
+	if (sceneName == "bunny") return new Scene_W4_Bunny();
+	if (sceneName == "manylights") return new Scene_ManyLights();
+
+	return nullptr;
+}
+
 void ShutDown(SDL_Window* pWindow)
 {
 	SDL_DestroyWindow(pWindow);
 	SDL_Quit();
 }
 
-int main(int argc, char* args[])
+//Renders the frames without a window and writes the last one to disk, the video subsystem never gets initialized
+int RunHeadless(const Options& options, Scene* pScene)
 {
-	//Unreferenced parameters
-	(void)argc;
-	(void)args;
+	const auto pTimer = new Timer();
+	const auto pRenderer = new Renderer(options.width, options.height);
+
+	if (!pRenderer->IsValid())
+	{
+		delete pRenderer;
+		delete pTimer;
+
+		return 1;
+	}
 
+	if (options.manyLightsEnabled)
+	{
+		pRenderer->ToggleManyLights();
+	}
+
+	pTimer->Start();
+
+	int renderedFrames{};
+
+	for (int frame{}; frame < options.frameCount; ++frame)
+	{
+		pScene->Update(pTimer);
+
+		if (pRenderer->Render(pScene))
+		{
+			++renderedFrames;
+		}
+
+		pTimer->Update();
+	}
+
+	pTimer->Stop();
+
+	std::cout << renderedFrames << " of " << options.frameCount << " frames rendered in " << pTimer->GetTotal() << "s" << std::endl;
+
+	const bool isSaved{ !pRenderer->SaveBufferToImage(options.outputPath.c_str()) };
+
+	if (isSaved)
+		std::cout << "Saved " << options.outputPath << std::endl;
+	else
+		std::cout << "Something went wrong. " << options.outputPath << " not saved!" << std::endl;
+
+	delete pRenderer;
+	delete pTimer;
+
+	return isSaved ? 0 : 1;
+}
+
+int RunWindowed(const Options& options, Scene* pScene)
+{
 	//Create window + surfaces
 	SDL_Init(SDL_INIT_VIDEO);
 
-	const uint32_t width = 640;
-	const uint32_t height = 480;
-
 	SDL_Window* pWindow = SDL_CreateWindow(
 		"RayTracer - Twannes Claes (2DAE15)",
 		SDL_WINDOWPOS_UNDEFINED,
 		SDL_WINDOWPOS_UNDEFINED,
-		width, height, 0);
+		options.width, options.height, 0);
 
 	if (!pWindow)
 		return 1;
@@ -47,10 +153,10 @@ int main(int argc, char* args[])
 	const auto pTimer = new Timer();
 	const auto pRenderer = new Renderer(pWindow);
 
-	const auto pScene = new Scene_W4_ReferenceScene();
-	//const auto pScene = new Scene_W4_Bunny();
-
-	pScene->Initialize();
+	if (options.manyLightsEnabled)
+	{
+		pRenderer->ToggleManyLights();
+	}
 
 	//Start loop
 	pTimer->Start();
@@ -84,6 +190,26 @@ int main(int argc, char* args[])
 				{
 					pRenderer->CycleLightingMode();
 				}
+				else if (e.key.keysym.scancode == SDL_SCANCODE_F4)
+				{
+					pRenderer->TogglePacketTracing();
+				}
+				else if (e.key.keysym.scancode == SDL_SCANCODE_F5)
+				{
+					pRenderer->ToggleManyLights();
+				}
+				else if (e.key.keysym.scancode == SDL_SCANCODE_F7)
+				{
+					pRenderer->ToggleAdaptiveAA();
+				}
+				else if (e.key.keysym.scancode == SDL_SCANCODE_F8)
+				{
+					pRenderer->CycleToneMapping();
+				}
+				else if (e.key.keysym.scancode == SDL_SCANCODE_F9)
+				{
+					pRenderer->ToggleSRGB();
+				}
 				else if (e.key.keysym.scancode == SDL_SCANCODE_LCTRL)
 				{
 					pRenderer->SetCameraLock(!pRenderer->getCameraLock());
@@ -110,7 +236,11 @@ int main(int argc, char* args[])
 		pScene->Update(pTimer);
 
 		//--------- Render ---------
-		pRenderer->Render(pScene);
+		//nothing to trace while the image stays converged, so don't spin at full speed
+		if (!pRenderer->Render(pScene))
+		{
+			SDL_Delay(10);
+		}
 
 		//--------- Timer ---------
 		pTimer->Update();
@@ -136,10 +266,39 @@ int main(int argc, char* args[])
 	pTimer->Stop();
 
 	//Shutdown "framework"
-	delete pScene;
 	delete pRenderer;
 	delete pTimer;
 
 	ShutDown(pWindow);
 	return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char* args[])
+{
+	Options options{};
+
+	if (!ParseOptions(argc, args, options))
+	{
+		std::cout << "Usage: RayTracer [--headless] [--frames N] [--output file.bmp] [--scene w1|w2|w3|w4|reference|bunny|manylights] [--width W] [--height H] [--many-lights] [--threads N] [--pin-threads]" << std::endl;
+		return 1;
+	}
+
+	//before anything gets a chance to start the pool
+	ThreadPool::Configure(static_cast<uint32_t>(options.threadCount), options.pinThreads);
+
+	const auto pScene = CreateScene(options.sceneName);
+
+	if (!pScene)
+	{
+		std::cout << "Unknown scene: " << options.sceneName << std::endl;
+		return 1;
+	}
+
+	pScene->Initialize();
+
+	const int result{ options.isHeadless ? RunHeadless(options, pScene) : RunWindowed(options, pScene) };
+
+	delete pScene;
+
+	return result;
+}